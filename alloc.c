@@ -0,0 +1,108 @@
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "alloc.h"
+
+// Bits of word w that stand for blocks the allocator may hand out
+static uint64_t word_mask( struct alloc *a, int w )
+{
+	uint64_t mask = ~(uint64_t)0;
+	int base = w*64;
+
+	if(a->first>base) mask = a->first-base>=64 ? 0 : mask << (a->first-base);
+	if(a->nblocks<base+64) mask &= a->nblocks<=base ? 0 : ~(uint64_t)0 >> (base+64-a->nblocks);
+	return mask;
+}
+
+// Claim the lowest free bit of word w, or return -1 if it has none. A bit
+// taken by another thread between the load and the fetch-and shows up as
+// already clear in the old value, and the next free bit is tried instead.
+static int word_claim( struct alloc *a, int w )
+{
+	uint64_t mask = word_mask(a,w);
+	uint64_t v = __atomic_load_n(&a->bitmap[w],__ATOMIC_RELAXED) & mask;
+
+	while(v) {
+		uint64_t bit = v & -v;
+		uint64_t old = __atomic_fetch_and(&a->bitmap[w],~bit,__ATOMIC_ACQUIRE);
+		if(old & bit) return w*64 + __builtin_ctzll(bit);
+		v = old & mask;
+	}
+	return -1;
+}
+
+static int region_claim( struct alloc *a, struct alloc_arena *arena, int region )
+{
+	int words = (a->nblocks+63)/64;
+	int start = region*ALLOC_REGION_WORDS;
+	int end = start+ALLOC_REGION_WORDS < words ? start+ALLOC_REGION_WORDS : words;
+	int hint = __atomic_load_n(&arena->word,__ATOMIC_RELAXED);
+	int i, b;
+
+	if(hint<start || hint>=end) hint = start;
+	for(i=0;i<end-start;i++) {
+		int w = start + (hint-start+i)%(end-start);
+		b = word_claim(a,w);
+		if(b>=0) {
+			__atomic_store_n(&arena->word,w,__ATOMIC_RELAXED);
+			return b;
+		}
+	}
+	return -1;
+}
+
+// The arenas start spread evenly over the bitmap. With narenas 0 there is
+// one per CPU.
+void alloc_init( struct alloc *a, uint64_t *bitmap, int nblocks, int first, int narenas )
+{
+	int i;
+	long ncpus = narenas>0 ? narenas : sysconf(_SC_NPROCESSORS_CONF);
+
+	a->bitmap = bitmap;
+	a->nblocks = nblocks;
+	a->first = first;
+	a->nregions = ((nblocks+63)/64 + ALLOC_REGION_WORDS-1)/ALLOC_REGION_WORDS;
+	if(a->nregions<1) a->nregions = 1;
+	a->narenas = ncpus<1 ? 1 : ncpus>ALLOC_ARENAS_MAX ? ALLOC_ARENAS_MAX : ncpus;
+	for(i=0;i<a->narenas;i++) {
+		a->arena[i].region = (long long)i*a->nregions/a->narenas;
+		a->arena[i].word = a->arena[i].region*ALLOC_REGION_WORDS;
+	}
+	a->next_region = 0;
+}
+
+// Returns a block number, now marked in use, or -1 if there are none free
+int alloc_block( struct alloc *a )
+{
+	int cpu = sched_getcpu();
+	struct alloc_arena *arena = &a->arena[(cpu<0 ? 0 : cpu) % a->narenas];
+	int region = __atomic_load_n(&arena->region,__ATOMIC_RELAXED);
+	int tries, w, b;
+
+	for(tries=0;tries<=a->nregions;tries++) {
+		b = region_claim(a,arena,region);
+		if(b>=0) return b;
+
+		// Dry: move this arena on to the next region in line
+		region = (unsigned)__atomic_fetch_add(&a->next_region,1,__ATOMIC_RELAXED) % a->nregions;
+		__atomic_store_n(&arena->region,region,__ATOMIC_RELAXED);
+	}
+
+	// Other arenas kept the cursor moving past regions this one never saw
+	for(w=0;w<(a->nblocks+63)/64;w++) {
+		b = word_claim(a,w);
+		if(b>=0) {
+			__atomic_store_n(&arena->region,w/ALLOC_REGION_WORDS,__ATOMIC_RELAXED);
+			return b;
+		}
+	}
+	return -1;
+}
+
+void alloc_free( struct alloc *a, int blocknum )
+{
+	__atomic_fetch_or(&a->bitmap[blocknum>>6],(uint64_t)1 << (blocknum&63),__ATOMIC_RELEASE);
+}
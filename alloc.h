@@ -0,0 +1,47 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdint.h>
+
+// Concurrent block allocator over a free block bitmap (a set bit is a free
+// block). Bits are claimed with an atomic fetch-and on their 64-bit word
+// and returned with an atomic fetch-or, so no lock is taken on any path.
+//
+// The bitmap is split into regions of ALLOC_REGION_WORDS words. Each CPU
+// has an arena that carves blocks out of one region at a time, so threads
+// on different CPUs work on different cache lines and a single thread gets
+// runs of neighbouring blocks. An arena whose region runs dry moves to the
+// next region off a shared cursor; only when a lap of the cursor finds
+// nothing is the whole bitmap searched before giving up.
+//
+// The file system calls alloc_block and alloc_free under fs->lock with a
+// single arena, so one writer's blocks stay together whichever CPU it runs
+// on; every block it frees goes through alloc_free, or through the same
+// atomic fetch-or in scan_pointers. The non-atomic bitmap writes in fs.c
+// (mount, log segments, resize) happen under that lock too, before or
+// instead of any allocation. Per-CPU arenas (narenas 0) are for callers
+// without such a lock, like alloc_bench.
+
+#define ALLOC_REGION_WORDS 64 // 4096 blocks
+#define ALLOC_ARENAS_MAX   64
+
+struct alloc_arena {
+	int region; // region blocks are being taken from
+	int word;   // word of the bitmap to look at first
+} __attribute__((aligned(64)));
+
+struct alloc {
+	uint64_t *bitmap;
+	int nblocks;
+	int first;    // lowest block that may be handed out
+	int nregions;
+	int narenas;
+	struct alloc_arena arena[ALLOC_ARENAS_MAX];
+	int next_region __attribute__((aligned(64)));
+};
+
+void alloc_init( struct alloc *a, uint64_t *bitmap, int nblocks, int first, int narenas );
+int  alloc_block( struct alloc *a );
+void alloc_free( struct alloc *a, int blocknum );
+
+#endif
@@ -0,0 +1,167 @@
+
+#include "alloc.h"
+#include "bitmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Allocation throughput from 1 to 64 threads, for the arena allocator and
+// for a single lock around a next-fit scan of the same bitmap. Each thread
+// takes HELD blocks and gives them back, over and over, for a fixed time.
+// Every block handed out is checked off in an owner array, so a block
+// given to two threads at once is counted as an error.
+
+#define HELD 64
+
+struct locked {
+	pthread_mutex_t lock;
+	uint64_t *bitmap;
+	int nblocks;
+	int cursor;
+};
+
+static struct alloc arenas;
+static struct locked locked;
+static unsigned char *owned;
+static volatile int stop;
+static int use_arenas;
+
+static int locked_block( struct locked *l )
+{
+	int i, b = -1;
+
+	pthread_mutex_lock(&l->lock);
+	for(i=0;i<l->nblocks;i++) {
+		int c = (l->cursor+i)%l->nblocks;
+		if(bitmap_test(l->bitmap,c)) {
+			bitmap_clear(l->bitmap,c);
+			l->cursor = c+1;
+			b = c;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&l->lock);
+	return b;
+}
+
+static void locked_free( struct locked *l, int b )
+{
+	pthread_mutex_lock(&l->lock);
+	bitmap_set(l->bitmap,b);
+	pthread_mutex_unlock(&l->lock);
+}
+
+struct worker {
+	pthread_t thread;
+	long long ops;
+	long long errors;
+};
+
+static void *worker( void *arg )
+{
+	struct worker *w = arg;
+	int held[HELD];
+	int i, n;
+
+	while(!stop) {
+		for(n=0;n<HELD;n++) {
+			held[n] = use_arenas ? alloc_block(&arenas) : locked_block(&locked);
+			if(held[n]<0) break;
+			if(__atomic_exchange_n(&owned[held[n]],1,__ATOMIC_RELAXED)) w->errors++;
+		}
+		for(i=0;i<n;i++) {
+			__atomic_store_n(&owned[held[i]],0,__ATOMIC_RELAXED);
+			if(use_arenas) alloc_free(&arenas,held[i]);
+			else locked_free(&locked,held[i]);
+		}
+		w->ops += n;
+	}
+	return 0;
+}
+
+// Fill a fresh bitmap so that fill percent of it is in use, at random
+static void fill_bitmap( uint64_t *bm, int nblocks, int fill )
+{
+	int b;
+
+	memset(bm,0xff,BITMAP_WORDS(nblocks)*sizeof(uint64_t));
+	srand(1);
+	for(b=0;b<nblocks;b++) {
+		if(rand()%100<fill) bitmap_clear(bm,b);
+	}
+}
+
+static double run( int nthreads, int milliseconds, long long *errors )
+{
+	struct worker *workers = calloc(nthreads,sizeof(struct worker));
+	struct timespec pause = {milliseconds/1000,(milliseconds%1000)*1000000L};
+	long long ops = 0;
+	int i;
+
+	stop = 0;
+	for(i=0;i<nthreads;i++) pthread_create(&workers[i].thread,0,worker,&workers[i]);
+	nanosleep(&pause,0);
+	stop = 1;
+	for(i=0;i<nthreads;i++) {
+		pthread_join(workers[i].thread,0);
+		ops += workers[i].ops;
+		*errors += workers[i].errors;
+	}
+	free(workers);
+	return ops / (milliseconds/1000.0) / 1e6;
+}
+
+int main( int argc, char *argv[] )
+{
+	int nblocks = 1<<20, fill = 50, milliseconds = 500;
+	long long errors = 0;
+	int t;
+
+	if(argc>4) {
+		printf("use: %s [<nblocks> [<fill percent> [<milliseconds>]]]\n",argv[0]);
+		return 1;
+	}
+	if(argc>1) nblocks = atoi(argv[1]);
+	if(argc>2) fill = atoi(argv[2]);
+	if(argc>3) milliseconds = atoi(argv[3]);
+	if(nblocks<=0 || fill<0 || fill>=100 || milliseconds<=0) {
+		printf("bad arguments\n");
+		return 1;
+	}
+
+	uint64_t *bm = malloc(BITMAP_WORDS(nblocks)*sizeof(uint64_t));
+	owned = calloc(nblocks,1);
+	if(!bm || !owned) {
+		printf("out of memory\n");
+		return 1;
+	}
+
+	printf("%d blocks, %d%% in use, %d ms per run\n",nblocks,fill,milliseconds);
+	printf("threads   locked Mops/s   arenas Mops/s\n");
+	for(t=1;t<=64;t*=2) {
+		double l, a;
+
+		fill_bitmap(bm,nblocks,fill);
+		pthread_mutex_init(&locked.lock,0);
+		locked.bitmap = bm;
+		locked.nblocks = nblocks;
+		locked.cursor = 0;
+		use_arenas = 0;
+		l = run(t,milliseconds,&errors);
+
+		fill_bitmap(bm,nblocks,fill);
+		alloc_init(&arenas,bm,nblocks,0,0);
+		use_arenas = 1;
+		a = run(t,milliseconds,&errors);
+
+		printf("%7d   %13.2f   %13.2f\n",t,l,a);
+	}
+	printf("%lld blocks handed out twice\n",errors);
+
+	free(owned);
+	free(bm);
+	return errors!=0;
+}
@@ -0,0 +1,26 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Packed bitmaps, one bit per block, 64 blocks per word
+
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+static inline bool bitmap_test( const uint64_t *bm, int bit )
+{
+	return (bm[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static inline void bitmap_set( uint64_t *bm, int bit )
+{
+	bm[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+static inline void bitmap_clear( uint64_t *bm, int bit )
+{
+	bm[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+}
+
+#endif
@@ -0,0 +1,811 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "pool.h"
+#include "probe.h"
+
+// Every cached block, and every ghost, has an entry. Entries sit on one of
+// the four lists of their partition, most recently used at the head, and
+// on a hash chain by block number. Ghosts have no data. A partition never
+// has more than twice as many entries as it has room for blocks.
+
+#define T1 CACHE_RECENT
+#define T2 CACHE_FREQUENT
+#define B1 CACHE_GHOST_RECENT
+#define B2 CACHE_GHOST_FREQUENT
+
+struct cache_entry {
+	int blocknum;
+	int list;
+	int prev;
+	int next;
+	int hnext;
+	char *data;
+	int dirty;
+	long long dirtied; // when it last went from clean to dirty, in ms
+	int prefetched;    // read ahead and not asked for yet
+	int once;          // will not be read again, so goes without a ghost
+};
+
+struct cache_list {
+	int head;
+	int tail;
+	int size;
+};
+
+struct partition {
+	struct cache *owner;
+	struct cache_entry *entries;
+	int *hash;
+	int hash_mask;
+	int free_entries;
+	struct cache_list lists[4];
+	int capacity;
+	int target;
+	long long hits[4];
+	long long misses;
+};
+
+// Everything a cache holds for its disk. The pinned range is one buffer
+// of consecutive blocks.
+struct cache {
+	disk_t *disk;
+	struct partition partitions[2];
+	int writeback;
+	int ndirty;
+	long long bypassed;
+	long long prefetched;
+	long long prefetch_hits;
+	char *pinned;
+	int pinned_start;
+	int pinned_count;
+	long long pinned_hits;
+	FILE *trace;
+};
+
+static int hash_slot( struct partition *p, int blocknum )
+{
+	return (blocknum*2654435761u) & p->hash_mask;
+}
+
+static int entry_find( struct partition *p, int blocknum )
+{
+	int e;
+	if(!p->capacity) return -1;
+	for(e=p->hash[hash_slot(p,blocknum)];e>=0;e=p->entries[e].hnext) {
+		if(p->entries[e].blocknum==blocknum) return e;
+	}
+	return -1;
+}
+
+static void list_remove( struct partition *p, int e )
+{
+	struct cache_entry *entries = p->entries;
+	struct cache_list *l = &p->lists[entries[e].list];
+	if(entries[e].prev>=0) entries[entries[e].prev].next = entries[e].next;
+	else l->head = entries[e].next;
+	if(entries[e].next>=0) entries[entries[e].next].prev = entries[e].prev;
+	else l->tail = entries[e].prev;
+	l->size--;
+}
+
+static void list_push( struct partition *p, int list, int e )
+{
+	struct cache_entry *entries = p->entries;
+	struct cache_list *l = &p->lists[list];
+	entries[e].list = list;
+	entries[e].prev = -1;
+	entries[e].next = l->head;
+	if(l->head>=0) entries[l->head].prev = e;
+	else l->tail = e;
+	l->head = e;
+	l->size++;
+}
+
+static void list_move( struct partition *p, int e, int list )
+{
+	list_remove(p,e);
+	list_push(p,list,e);
+}
+
+// Put an entry at the cold end of a list instead, next in line to go
+static void list_append( struct partition *p, int list, int e )
+{
+	struct cache_entry *entries = p->entries;
+	struct cache_list *l = &p->lists[list];
+	entries[e].list = list;
+	entries[e].next = -1;
+	entries[e].prev = l->tail;
+	if(l->tail>=0) entries[l->tail].next = e;
+	else l->head = e;
+	l->tail = e;
+	l->size++;
+}
+
+static long long now_ms()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000LL + t.tv_nsec/1000000;
+}
+
+static void trace( cache_t *c, int blocknum, int kind, int write )
+{
+	struct cache_trace_record r = {blocknum,kind,write,0};
+	if(c->trace) fwrite(&r,sizeof(r),1,c->trace);
+}
+
+static void mark_clean( struct partition *p, int e )
+{
+	if(!p->entries[e].dirty) return;
+	p->entries[e].dirty = 0;
+	p->owner->ndirty--;
+}
+
+// A dirty block is written out before its data is let go
+static void write_back( struct partition *p, int e )
+{
+	if(!p->entries[e].dirty) return;
+	disk_write(p->owner->disk,p->entries[e].blocknum,p->entries[e].data);
+	mark_clean(p,e);
+}
+
+static int entry_alloc( struct partition *p, int blocknum, int list )
+{
+	int e = p->free_entries;
+	p->free_entries = p->entries[e].next;
+
+	int slot = hash_slot(p,blocknum);
+	p->entries[e].blocknum = blocknum;
+	p->entries[e].data = 0;
+	p->entries[e].dirty = 0;
+	p->entries[e].prefetched = 0;
+	p->entries[e].once = 0;
+	p->entries[e].hnext = p->hash[slot];
+	p->hash[slot] = e;
+	list_push(p,list,e);
+	return e;
+}
+
+static void entry_drop( struct partition *p, int e )
+{
+	int *h = &p->hash[hash_slot(p,p->entries[e].blocknum)];
+	while(*h!=e) h = &p->entries[*h].hnext;
+	*h = p->entries[e].hnext;
+
+	list_remove(p,e);
+	mark_clean(p,e);
+	pool_put(p->entries[e].data);
+	p->entries[e].data = 0;
+	p->entries[e].next = p->free_entries;
+	p->free_entries = e;
+}
+
+static int resident( struct partition *p )
+{
+	return p->lists[T1].size + p->lists[T2].size;
+}
+
+// Turn the least recent block of T1 or T2 into a ghost, whichever list is
+// over its share
+static void replace( struct partition *p, int ghost_list )
+{
+	int t1 = p->lists[T1].size, e;
+	if(p->lists[T2].size==0 || (t1>0 && (t1>p->target || (ghost_list==B2 && t1==p->target)))) {
+		e = p->lists[T1].tail;
+		list_move(p,e,B1);
+	} else {
+		e = p->lists[T2].tail;
+		list_move(p,e,B2);
+	}
+	write_back(p,e);
+	if(p->entries[e].once) {
+		// Nothing is learned from a block that was only ever going to be read once
+		entry_drop(p,e);
+		return;
+	}
+	pool_put(p->entries[e].data);
+	p->entries[e].data = 0;
+}
+
+// Make room for a block that was not in the cache or ghost lists
+static void make_room_miss( struct partition *p )
+{
+	struct cache_list *lists = p->lists;
+	int total = resident(p) + lists[B1].size + lists[B2].size;
+
+	if(lists[T1].size+lists[B1].size>=p->capacity) {
+		if(lists[B1].size>0) {
+			entry_drop(p,lists[B1].tail);
+			if(resident(p)>=p->capacity) replace(p,-1);
+		} else {
+			write_back(p,lists[T1].tail);
+			entry_drop(p,lists[T1].tail);
+		}
+	} else if(total>=p->capacity) {
+		if(total>=2*p->capacity) entry_drop(p,lists[B2].size ? lists[B2].tail : lists[B1].tail);
+		if(resident(p)>=p->capacity) replace(p,-1);
+	}
+}
+
+// Find or make an entry for a block and put it at the head of the lists,
+// adapting the target on a ghost hit. Returns the entry; its data is set
+// only if the block was already cached.
+static int arc_access( struct partition *p, int blocknum )
+{
+	int e = entry_find(p,blocknum);
+	if(e>=0 && p->entries[e].data) {
+		p->hits[p->entries[e].list]++;
+		p->entries[e].once = 0;
+		if(p->entries[e].prefetched) {
+			// The first use of a block read ahead is its first access
+			p->entries[e].prefetched = 0;
+			p->owner->prefetch_hits++;
+			list_move(p,e,T1);
+			return e;
+		}
+		list_move(p,e,T2);
+		return e;
+	}
+
+	if(e>=0) {
+		// A ghost hit means the list it was evicted from deserved more room
+		int list = p->entries[e].list;
+		int b1 = p->lists[B1].size, b2 = p->lists[B2].size;
+		p->hits[list]++;
+		if(list==B1) {
+			p->target += b2>b1 ? b2/b1 : 1;
+			if(p->target>p->capacity) p->target = p->capacity;
+		} else {
+			p->target -= b1>b2 ? b1/b2 : 1;
+			if(p->target<0) p->target = 0;
+		}
+		if(resident(p)>=p->capacity) replace(p,list);
+		list_move(p,e,T2);
+	} else {
+		p->misses++;
+		make_room_miss(p);
+		e = entry_alloc(p,blocknum,T1);
+	}
+	return e;
+}
+
+// A block that changes role, e.g. a freed data block reused as an
+// indirect block, leaves its old partition. Dirty data it held is written
+// out first, as cache_release does: the cache cannot tell whether the
+// block was freed or is still in use under the old role, and whatever
+// comes next either reads that or writes over it.
+static void forget( cache_t *c, int blocknum, int kind )
+{
+	struct partition *other = &c->partitions[!kind];
+	int e = entry_find(other,blocknum);
+	if(e<0) return;
+	if(other->entries[e].data) write_back(other,e);
+	entry_drop(other,e);
+}
+
+static int is_pinned( cache_t *c, int blocknum )
+{
+	return c->pinned && blocknum>=c->pinned_start && blocknum<c->pinned_start+c->pinned_count;
+}
+
+static void partition_free( struct partition *p )
+{
+	int i;
+
+	if(!p->capacity) return;
+	for(i=0;i<2*p->capacity;i++) {
+		if(p->entries[i].data) write_back(p,i);
+		pool_put(p->entries[i].data);
+	}
+	free(p->entries);
+	free(p->hash);
+	p->entries = 0;
+	p->hash = 0;
+	p->capacity = 0;
+}
+
+static int partition_init( cache_t *c, struct partition *p, int n )
+{
+	int i, nhash;
+
+	memset(p,0,sizeof(*p));
+	p->owner = c;
+	if(n<=0) return 1;
+
+	for(nhash=1;nhash<4*n;nhash*=2) {}
+	p->entries = malloc(2*n*sizeof(struct cache_entry));
+	p->hash = malloc(nhash*sizeof(int));
+	if(!p->entries || !p->hash) {
+		free(p->entries);
+		free(p->hash);
+		p->entries = 0;
+		p->hash = 0;
+		return 0;
+	}
+
+	for(i=0;i<nhash;i++) p->hash[i] = -1;
+	p->hash_mask = nhash-1;
+	for(i=0;i<2*n;i++) {
+		p->entries[i].data = 0;
+		p->entries[i].dirty = 0;
+		p->entries[i].next = i+1<2*n ? i+1 : -1;
+	}
+	p->free_entries = 0;
+	for(i=0;i<4;i++) {
+		p->lists[i].head = p->lists[i].tail = -1;
+	}
+	p->capacity = n;
+	return 1;
+}
+
+// A new cache has no capacity, so it passes everything to the disk until
+// cache_init gives it some
+cache_t *cache_open( disk_t *disk )
+{
+	cache_t *c = calloc(1,sizeof(cache_t));
+	if(!c) return 0;
+	c->disk = disk;
+	return c;
+}
+
+// Pinned blocks are kept across a change of capacity
+int cache_init( cache_t *c, int capacity, int meta_capacity )
+{
+	partition_free(&c->partitions[CACHE_DATA]);
+	partition_free(&c->partitions[CACHE_META]);
+
+	if(!partition_init(c,&c->partitions[CACHE_DATA],capacity) || !partition_init(c,&c->partitions[CACHE_META],meta_capacity)) {
+		partition_free(&c->partitions[CACHE_DATA]);
+		return 0;
+	}
+	return 1;
+}
+
+void cache_read( cache_t *c, int blocknum, char *data, int kind )
+{
+	struct partition *p = &c->partitions[kind];
+
+	if(is_pinned(c,blocknum)) {
+		c->pinned_hits++;
+		PROBE2(cache_hit,blocknum,kind);
+		memcpy(data,c->pinned+(blocknum-c->pinned_start)*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		return;
+	}
+	trace(c,blocknum,kind,0);
+	if(!p->capacity) {
+		PROBE2(cache_miss,blocknum,kind);
+		disk_read(c->disk,blocknum,data);
+		return;
+	}
+
+	int e = arc_access(p,blocknum);
+	if(p->entries[e].data) {
+		PROBE2(cache_hit,blocknum,kind);
+	} else {
+		PROBE2(cache_miss,blocknum,kind);
+		forget(c,blocknum,kind);
+		p->entries[e].data = pool_get();
+		disk_read(c->disk,blocknum,p->entries[e].data);
+	}
+	memcpy(data,p->entries[e].data,DISK_BLOCK_SIZE);
+}
+
+// Read count consecutive data blocks from the disk in one request, without
+// bringing them in or counting them as accesses. A dirty cached copy is
+// newer than the disk, so it replaces what was read.
+void cache_read_direct( cache_t *c, int blocknum, int count, char *data )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	int i, e;
+
+	disk_readv(c->disk,blocknum,count,data);
+	c->bypassed += count;
+	if(!c->ndirty) return;
+
+	for(i=0;i<count;i++) {
+		e = entry_find(p,blocknum+i);
+		if(e>=0 && p->entries[e].dirty) {
+			memcpy(data+(size_t)i*DISK_BLOCK_SIZE,p->entries[e].data,DISK_BLOCK_SIZE);
+		}
+	}
+}
+
+// Read a data block that will not be read again. A cached copy is used
+// but not promoted, and a block that is not cached comes in at the cold
+// end of the recency list, so it is the next to go and leaves no ghost.
+void cache_read_once( cache_t *c, int blocknum, char *data )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	int e;
+
+	trace(c,blocknum,CACHE_DATA,0);
+	if(!p->capacity) {
+		PROBE2(cache_miss,blocknum,CACHE_DATA);
+		disk_read(c->disk,blocknum,data);
+		return;
+	}
+
+	e = entry_find(p,blocknum);
+	if(e>=0 && p->entries[e].data) {
+		PROBE2(cache_hit,blocknum,CACHE_DATA);
+		p->hits[p->entries[e].list]++;
+		if(p->entries[e].prefetched) {
+			p->entries[e].prefetched = 0;
+			c->prefetch_hits++;
+			if(p->entries[e].once) {
+				list_remove(p,e);
+				list_append(p,T1,e);
+			}
+		}
+		memcpy(data,p->entries[e].data,DISK_BLOCK_SIZE);
+		return;
+	}
+	PROBE2(cache_miss,blocknum,CACHE_DATA);
+	if(e>=0) {
+		// A ghost keeps its history for blocks that are used again
+		disk_read(c->disk,blocknum,data);
+		return;
+	}
+
+	p->misses++;
+	forget(c,blocknum,CACHE_DATA);
+	make_room_miss(p);
+	e = entry_alloc(p,blocknum,T1);
+	list_remove(p,e);
+	list_append(p,T1,e);
+	p->entries[e].once = 1;
+	p->entries[e].data = pool_get();
+	disk_read(c->disk,blocknum,p->entries[e].data);
+	memcpy(data,p->entries[e].data,DISK_BLOCK_SIZE);
+}
+
+#define PREFETCH_CLUSTER 64
+
+// Read ahead count consecutive data blocks, those not cached yet, with
+// one request per run. They go in at the head of the recency list but
+// count as accessed only when first read, and once marks them as blocks
+// that will be read just that one time. At most a quarter of the data
+// partition is filled per call. Returns the number of blocks read.
+int cache_prefetch( cache_t *c, int blocknum, int count, int once )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	char *cluster;
+	int i, n, e, done = 0;
+
+	if(!p->capacity || count<=0) return 0;
+	if(count>p->capacity/4) count = p->capacity/4;
+	if(posix_memalign((void **)&cluster,DISK_BLOCK_SIZE,PREFETCH_CLUSTER*DISK_BLOCK_SIZE)) return 0;
+
+	while(count>0) {
+		e = entry_find(p,blocknum);
+		if(e>=0 && p->entries[e].data) {
+			blocknum++;
+			count--;
+			continue;
+		}
+
+		for(n=1;n<count && n<PREFETCH_CLUSTER;n++) {
+			e = entry_find(p,blocknum+n);
+			if(e>=0 && p->entries[e].data) break;
+		}
+		disk_readv(c->disk,blocknum,n,cluster);
+		for(i=0;i<n;i++) {
+			e = entry_find(p,blocknum+i);
+			if(e>=0) entry_drop(p,e);
+			forget(c,blocknum+i,CACHE_DATA);
+			make_room_miss(p);
+			e = entry_alloc(p,blocknum+i,T1);
+			p->entries[e].prefetched = 1;
+			p->entries[e].once = once;
+			p->entries[e].data = pool_get();
+			memcpy(p->entries[e].data,cluster+i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		}
+		blocknum += n;
+		count -= n;
+		done += n;
+	}
+	free(cluster);
+	c->prefetched += done;
+	return done;
+}
+
+// Let go of count consecutive data blocks, writing out any that are dirty
+void cache_release( cache_t *c, int blocknum, int count )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	int i, e;
+
+	for(i=0;i<count;i++) {
+		e = entry_find(p,blocknum+i);
+		if(e<0) continue;
+		if(p->entries[e].data) write_back(p,e);
+		entry_drop(p,e);
+	}
+}
+
+// Writes keep any cached copy current. Metadata that is written is about
+// to be read again, so it is brought in; data is not, so writing a large
+// file does not flush the data partition either.
+//
+// With write-back on, data is only written to the cache and marked dirty.
+// The disk sees it when cache_flush picks it up or it is evicted.
+void cache_write( cache_t *c, int blocknum, const char *data, int kind )
+{
+	struct partition *p = &c->partitions[kind];
+	int e;
+
+	if((kind==CACHE_META || c->writeback) && !is_pinned(c,blocknum)) trace(c,blocknum,kind,1);
+
+	if(kind==CACHE_DATA && c->writeback && p->capacity && !is_pinned(c,blocknum)) {
+		forget(c,blocknum,kind);
+		e = arc_access(p,blocknum);
+		if(!p->entries[e].data) p->entries[e].data = pool_get();
+		memcpy(p->entries[e].data,data,DISK_BLOCK_SIZE);
+		if(!p->entries[e].dirty) {
+			p->entries[e].dirty = 1;
+			p->entries[e].dirtied = now_ms();
+			c->ndirty++;
+		}
+		return;
+	}
+
+	disk_write(c->disk,blocknum,data);
+
+	if(is_pinned(c,blocknum)) {
+		memcpy(c->pinned+(blocknum-c->pinned_start)*DISK_BLOCK_SIZE,data,DISK_BLOCK_SIZE);
+		return;
+	}
+
+	forget(c,blocknum,kind);
+	if(kind==CACHE_META && p->capacity) {
+		e = arc_access(p,blocknum);
+		if(!p->entries[e].data) p->entries[e].data = pool_get();
+	} else {
+		e = entry_find(p,blocknum);
+		if(e<0 || !p->entries[e].data) return;
+	}
+	memcpy(p->entries[e].data,data,DISK_BLOCK_SIZE);
+	mark_clean(p,e);
+}
+
+static void update( cache_t *c, int blocknum, const char *data )
+{
+	int kind, e;
+
+	if(is_pinned(c,blocknum)) {
+		memcpy(c->pinned+(blocknum-c->pinned_start)*DISK_BLOCK_SIZE,data,DISK_BLOCK_SIZE);
+		return;
+	}
+	for(kind=0;kind<2;kind++) {
+		struct partition *p = &c->partitions[kind];
+		e = entry_find(p,blocknum);
+		if(e>=0 && p->entries[e].data) {
+			memcpy(p->entries[e].data,data,DISK_BLOCK_SIZE);
+			mark_clean(p,e);
+		}
+	}
+}
+
+void cache_writev( cache_t *c, int blocknum, int count, const char *data )
+{
+	int i;
+
+	disk_writev(c->disk,blocknum,count,data);
+	for(i=0;i<count;i++) {
+		update(c,blocknum+i,data+i*DISK_BLOCK_SIZE);
+	}
+}
+
+static void invalidate( cache_t *c, int blocknum, int count )
+{
+	int i, kind, e;
+
+	for(i=0;i<count;i++) {
+		for(kind=0;kind<2;kind++) {
+			e = entry_find(&c->partitions[kind],blocknum+i);
+			if(e>=0) entry_drop(&c->partitions[kind],e);
+		}
+	}
+}
+
+int cache_discard( cache_t *c, int blocknum, int count )
+{
+	int i;
+
+	invalidate(c,blocknum,count);
+	if(!disk_discard(c->disk,blocknum,count)) return 0;
+
+	// Discarded blocks read back as zeros
+	for(i=blocknum;i<blocknum+count;i++) {
+		if(is_pinned(c,i)) memset(c->pinned+(i-c->pinned_start)*DISK_BLOCK_SIZE,0,DISK_BLOCK_SIZE);
+	}
+	return 1;
+}
+
+int cache_resize( cache_t *c, int n )
+{
+	int old = disk_size(c->disk);
+
+	if(n<old) invalidate(c,n,old-n);
+	return disk_resize(c->disk,n);
+}
+
+// Read a range of blocks in and keep it for good. Only one range is
+// pinned at a time; pinning another replaces it.
+int cache_pin( cache_t *c, int blocknum, int count )
+{
+	int i;
+
+	cache_unpin(c);
+	if(count<=0) return 1;
+	if(posix_memalign((void **)&c->pinned,DISK_BLOCK_SIZE,(size_t)count*DISK_BLOCK_SIZE)) {
+		c->pinned = 0;
+		return 0;
+	}
+
+	invalidate(c,blocknum,count);
+	for(i=0;i<count;i++) {
+		disk_read(c->disk,blocknum+i,c->pinned+i*DISK_BLOCK_SIZE);
+	}
+	c->pinned_start = blocknum;
+	c->pinned_count = count;
+	return 1;
+}
+
+void cache_unpin( cache_t *c )
+{
+	free(c->pinned);
+	c->pinned = 0;
+	c->pinned_start = 0;
+	c->pinned_count = 0;
+}
+
+// Dirty blocks are written in block order, and each run of consecutive
+// blocks goes out as one request of up to FLUSH_CLUSTER blocks
+#define FLUSH_CLUSTER 64
+
+static int entry_compare( const void *a, const void *b, void *arg )
+{
+	struct cache_entry *entries = arg;
+	return entries[*(const int *)a].blocknum - entries[*(const int *)b].blocknum;
+}
+
+static int dirtied_compare( const void *a, const void *b, void *arg )
+{
+	struct cache_entry *entries = arg;
+	long long x = entries[*(const int *)a].dirtied, y = entries[*(const int *)b].dirtied;
+	return x<y ? -1 : x>y;
+}
+
+static int write_out( cache_t *c, int *list, int n )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	char *cluster;
+	int i, j, k;
+
+	if(n==0) return 0;
+	PROBE1(cache_flush_start,n);
+	if(posix_memalign((void **)&cluster,DISK_BLOCK_SIZE,FLUSH_CLUSTER*DISK_BLOCK_SIZE)) {
+		for(i=0;i<n;i++) write_back(p,list[i]);
+		PROBE1(cache_flush_done,n);
+		return n;
+	}
+
+	qsort_r(list,n,sizeof(int),entry_compare,p->entries);
+	for(i=0;i<n;i=j) {
+		for(j=i+1;j<n && j-i<FLUSH_CLUSTER && p->entries[list[j]].blocknum==p->entries[list[j-1]].blocknum+1;j++) {}
+		for(k=i;k<j;k++) memcpy(cluster+(k-i)*DISK_BLOCK_SIZE,p->entries[list[k]].data,DISK_BLOCK_SIZE);
+		disk_writev(c->disk,p->entries[list[i]].blocknum,j-i,cluster);
+		for(k=i;k<j;k++) mark_clean(p,list[k]);
+	}
+	free(cluster);
+	PROBE1(cache_flush_done,n);
+	return n;
+}
+
+// Write back up to max dirty blocks that have been dirty for at least
+// min_age ms, oldest first. Returns how many were written.
+int cache_flush( cache_t *c, int min_age, int max )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	long long now = now_ms();
+	int *list, n = 0, e, written;
+
+	if(c->ndirty==0 || max<=0) return 0;
+	list = malloc(c->ndirty*sizeof(int));
+	if(!list) return 0;
+	for(e=0;e<2*p->capacity && n<c->ndirty;e++) {
+		if(p->entries[e].data && p->entries[e].dirty && now-p->entries[e].dirtied>=min_age) list[n++] = e;
+	}
+	if(n>max) {
+		qsort_r(list,n,sizeof(int),dirtied_compare,p->entries);
+		n = max;
+	}
+	written = write_out(c,list,n);
+	free(list);
+	return written;
+}
+
+// Write back whichever of the given blocks are dirty
+int cache_flush_blocks( cache_t *c, const int *blocknums, int count )
+{
+	struct partition *p = &c->partitions[CACHE_DATA];
+	int *list, n = 0, i, e, written;
+
+	if(c->ndirty==0 || count<=0) return 0;
+	list = malloc(count*sizeof(int));
+	if(!list) return 0;
+	for(i=0;i<count;i++) {
+		e = entry_find(p,blocknums[i]);
+		if(e>=0 && p->entries[e].data && p->entries[e].dirty) {
+			p->entries[e].dirty = 2; // listed once even if named twice
+			list[n++] = e;
+		}
+	}
+	for(i=0;i<n;i++) p->entries[list[i]].dirty = 1;
+	written = write_out(c,list,n);
+	free(list);
+	return written;
+}
+
+// Turning write-back off writes out everything still dirty
+void cache_set_writeback( cache_t *c, int on )
+{
+	if(!on) cache_flush(c,0,c->ndirty);
+	c->writeback = on;
+}
+
+// Start recording accesses to a new file, or with no file name stop
+int cache_trace( cache_t *c, const char *filename )
+{
+	struct cache_trace_header header = {CACHE_TRACE_MAGIC,DISK_BLOCK_SIZE,disk_size(c->disk)};
+
+	if(c->trace) fclose(c->trace);
+	c->trace = 0;
+	if(!filename) return 1;
+
+	c->trace = fopen(filename,"w");
+	if(!c->trace) return 0;
+	fwrite(&header,sizeof(header),1,c->trace);
+	return 1;
+}
+
+void cache_stats( cache_t *c, struct cache_stats *s )
+{
+	int kind, i;
+
+	for(kind=0;kind<2;kind++) {
+		struct partition *p = &c->partitions[kind];
+		struct cache_partition_stats *ps = &s->part[kind];
+		ps->capacity = p->capacity;
+		ps->target = p->target;
+		for(i=0;i<4;i++) {
+			ps->size[i] = p->lists[i].size;
+			ps->hits[i] = p->hits[i];
+		}
+		ps->misses = p->misses;
+	}
+	s->dirty = c->ndirty;
+	s->bypassed = c->bypassed;
+	s->prefetched = c->prefetched;
+	s->prefetch_hits = c->prefetch_hits;
+	s->pinned = c->pinned_count;
+	s->pinned_hits = c->pinned_hits;
+}
+
+void cache_close( cache_t *c )
+{
+	if(!c) return;
+	partition_free(&c->partitions[CACHE_DATA]);
+	partition_free(&c->partitions[CACHE_META]);
+	cache_unpin(c);
+	cache_trace(c,0);
+	free(c);
+}
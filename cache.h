@@ -0,0 +1,108 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "disk.h"
+
+// A block cache in front of the emulated disk. It has the same calls as
+// the disk. Writes go straight through by default; with write-back on,
+// data writes are held in the cache and the disk is only current once
+// cache_flush has written them out.
+//
+// Every request says whether the block is file data or metadata (the
+// superblock, inode and inode map blocks, indirect blocks, segment
+// summaries). Each kind has its own partition with its own budget, so
+// no amount of data traffic can evict metadata.
+//
+// Replacement within a partition is ARC: blocks seen once sit on a recency
+// list, blocks seen again move to a frequency list, and ghost lists
+// remember what each list recently evicted to shift the split between
+// them. A long sequential read only ever cycles the recency list, so
+// blocks in use keep their place.
+//
+// With write-back on, a data write only marks the cached copy dirty, and
+// cache_flush or eviction writes it out. Metadata is always written through.
+//
+// Callers that know how data will be used can say so: blocks can be read
+// ahead, read without being kept for long, or let go early.
+//
+// Large reads of data can go around the cache, straight from the disk,
+// so streaming a file neither evicts anything nor costs a copy.
+//
+// One range of metadata blocks can also be pinned. Pinned blocks are held
+// outside both budgets and are never evicted.
+//
+// Every access that counts against a budget can be recorded to a trace
+// file, one record per block: reads, reads of blocks used once, and the
+// writes that bring blocks in. Pinned blocks, reads around the cache and
+// read-ahead are left out. mrc turns traces into miss ratio curves.
+//
+// A partition with a capacity of 0, including both of them until
+// cache_init is called, passes its requests straight to the disk.
+//
+// Each cache sits in front of one disk and keeps no global state. Callers
+// serialize the calls they make on any one cache.
+
+#define CACHE_DATA 0
+#define CACHE_META 1
+
+#define CACHE_RECENT         0
+#define CACHE_FREQUENT       1
+#define CACHE_GHOST_RECENT   2
+#define CACHE_GHOST_FREQUENT 3
+
+struct cache_partition_stats {
+	int capacity;
+	int target;         // blocks the recency list is allowed to hold
+	int size[4];        // blocks (or ghost entries) on each list
+	long long hits[4];  // requests found on each list
+	long long misses;
+};
+
+#define CACHE_TRACE_MAGIC 0x43545243
+
+struct cache_trace_header {
+	int magic;
+	int block_size;
+	int nblocks;  // of the disk, so no cache larger than it is considered
+};
+
+struct cache_trace_record {
+	int blocknum;
+	unsigned char kind;   // CACHE_DATA or CACHE_META
+	unsigned char write;
+	unsigned short unused;
+};
+
+struct cache_stats {
+	struct cache_partition_stats part[2];  // indexed by CACHE_DATA, CACHE_META
+	int dirty;
+	long long bypassed;  // data blocks read around the cache
+	long long prefetched;     // data blocks read ahead
+	long long prefetch_hits;  // and later asked for
+	int pinned;
+	long long pinned_hits;
+};
+
+typedef struct cache cache_t;
+
+cache_t *cache_open( disk_t *disk );
+int  cache_init( cache_t *c, int capacity, int meta_capacity );
+void cache_read( cache_t *c, int blocknum, char *data, int kind );
+void cache_read_direct( cache_t *c, int blocknum, int count, char *data );
+void cache_read_once( cache_t *c, int blocknum, char *data );
+int  cache_prefetch( cache_t *c, int blocknum, int count, int once );
+void cache_release( cache_t *c, int blocknum, int count );
+void cache_write( cache_t *c, int blocknum, const char *data, int kind );
+void cache_writev( cache_t *c, int blocknum, int count, const char *data );
+int  cache_discard( cache_t *c, int blocknum, int count );
+int  cache_resize( cache_t *c, int n );
+int  cache_pin( cache_t *c, int blocknum, int count );
+void cache_unpin( cache_t *c );
+void cache_set_writeback( cache_t *c, int on );
+int  cache_flush( cache_t *c, int min_age, int max );
+int  cache_flush_blocks( cache_t *c, const int *blocknums, int count );
+int  cache_trace( cache_t *c, const char *filename );
+void cache_stats( cache_t *c, struct cache_stats *s );
+void cache_close( cache_t *c );
+
+#endif
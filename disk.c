@@ -1,47 +1,194 @@
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "disk.h"
+#include "pool.h"
+#include "uring.h"
+#include "span.h"
+#include "probe.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+#define URING_ENTRIES 64
+#define URING_MAX     16 // rings per disk, one per thread doing I/O at once
+
+struct disk {
+	enum disk_backend backend;
+	FILE *file; // STDIO only
+	int fd;
+	int direct; // opened with O_DIRECT, and the host has not refused it
+	char *map;  // MMAP only
+
+	// URING: rings not in use right now, and how many there are in all
+	pthread_mutex_t rings_lock;
+	struct uring *rings[URING_MAX];
+	int nfree;
+	int nrings;
+
+	int nblocks;
+	int nreads;
+	int nwrites;
+	int ndiscards;
+	int nsyncs;
+};
+
+disk_t *disk_open( const char *filename, int n )
+{
+	return disk_open_backend(filename,n,DISK_STDIO);
+}
+
+disk_t *disk_open_backend( const char *filename, int n, enum disk_backend backend )
+{
+	disk_t *d = calloc(1,sizeof(disk_t));
+	if(!d) return 0;
+	d->backend = backend;
+	d->direct = backend==DISK_DIRECT || backend==DISK_URING;
+	pthread_mutex_init(&d->rings_lock,0);
+
+	if(backend==DISK_STDIO) {
+		d->file = fopen(filename,"r+");
+		if(!d->file) d->file = fopen(filename,"w+");
+		d->fd = d->file ? fileno(d->file) : -1;
+	} else {
+		d->fd = open(filename,O_RDWR|O_CREAT|(d->direct ? O_DIRECT : 0),0666);
+		if(d->fd<0 && d->direct && errno==EINVAL) {
+			d->direct = 0;
+			if(backend==DISK_DIRECT) d->backend = DISK_PREAD;
+			d->fd = open(filename,O_RDWR|O_CREAT,0666);
+		}
+	}
+	if(d->fd<0) {
+		free(d);
+		return 0;
+	}
+
+	// Extend the image to n blocks, but never cut off an image that was
+	// resized beyond what the caller asked for
+	struct stat info;
+	if(fstat(d->fd,&info)<0 || info.st_size<(off_t)n*DISK_BLOCK_SIZE) {
+		ftruncate(d->fd,(off_t)n*DISK_BLOCK_SIZE);
+	}
+
+	d->nblocks = n;
 
-int disk_init( const char *filename, int n )
+	// Backends that need more than the file fall back to plain system calls
+	if(backend==DISK_MMAP) {
+		d->map = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+		if(d->map==MAP_FAILED) {
+			d->map = 0;
+			d->backend = DISK_PREAD;
+		}
+	}
+	if(backend==DISK_URING) {
+		d->rings[0] = uring_open(URING_ENTRIES);
+		if(d->rings[0]) {
+			d->nfree = d->nrings = 1;
+		} else {
+			d->backend = d->direct ? DISK_DIRECT : DISK_PREAD;
+		}
+	}
+
+	return d;
+}
+
+int disk_size( disk_t *d )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return d->nblocks;
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+enum disk_backend disk_backend( disk_t *d )
+{
+	return d->backend;
+}
 
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
+const char *disk_backend_name( enum disk_backend backend )
+{
+	switch(backend) {
+		case DISK_STDIO:  return "stdio";
+		case DISK_PREAD:  return "pread";
+		case DISK_DIRECT: return "direct";
+		case DISK_MMAP:   return "mmap";
+		case DISK_URING:  return "uring";
+		default:          break;
+	}
+	return "unknown";
+}
 
+// Some host file systems accept O_DIRECT at open but refuse the I/O.
+// The disk then carries on through the page cache.
+static int direct_fallback( disk_t *d )
+{
+	int flags = fcntl(d->fd,F_GETFL);
+	if(flags<0 || fcntl(d->fd,F_SETFL,flags&~O_DIRECT)<0) return 0;
+	d->direct = 0;
+	if(d->backend==DISK_DIRECT) d->backend = DISK_PREAD;
 	return 1;
 }
 
-int disk_size()
+// Move count blocks between data and the image with positioned system
+// calls, finishing short transfers
+static int fd_io( disk_t *d, int write, int blocknum, int count, char *data )
 {
-	return nblocks;
+	off_t offset = (off_t)blocknum*DISK_BLOCK_SIZE;
+	size_t length = (size_t)count*DISK_BLOCK_SIZE, done = 0;
+	ssize_t result;
+
+	while(done<length) {
+		if(write) {
+			result = pwrite(d->fd,data+done,length-done,offset+done);
+		} else {
+			result = pread(d->fd,data+done,length-done,offset+done);
+		}
+		if(result<0 && errno==EINTR) continue;
+		if(result<0 && errno==EINVAL && d->direct && direct_fallback(d)) continue;
+		if(result==0) errno = EIO; // past the end of the image
+		if(result<=0) return 0;
+		done += result;
+	}
+	return 1;
 }
 
-static void sanity_check( int blocknum, const void *data )
+// O_DIRECT needs aligned memory; a buffer that is not goes one block at a
+// time through one from the pool
+static int direct_io( disk_t *d, int write, int blocknum, int count, char *data )
+{
+	char *bounce;
+	int i, ok = 1;
+
+	if(!d->direct || (uintptr_t)data%DISK_BLOCK_SIZE==0) {
+		return fd_io(d,write,blocknum,count,data);
+	}
+
+	bounce = pool_get();
+	if(!bounce) return 0;
+	for(i=0;i<count && ok;i++) {
+		if(write) memcpy(bounce,data+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		ok = fd_io(d,write,blocknum+i,1,bounce);
+		if(!write && ok) memcpy(data+(size_t)i*DISK_BLOCK_SIZE,bounce,DISK_BLOCK_SIZE);
+	}
+	pool_put(bounce);
+	return ok;
+}
+
+static void sanity_check( disk_t *d, int blocknum, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
+	if(blocknum>=d->nblocks) {
 		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
 		abort();
 	}
@@ -52,41 +199,302 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+// A ring for the calling thread to use on its own, if one can be had
+static struct uring *ring_get( disk_t *d )
+{
+	struct uring *r = 0;
+	int create = 0;
+
+	pthread_mutex_lock(&d->rings_lock);
+	if(d->nfree>0) {
+		r = d->rings[--d->nfree];
+	} else if(d->nrings<URING_MAX) {
+		d->nrings++;
+		create = 1;
+	}
+	pthread_mutex_unlock(&d->rings_lock);
+
+	if(create) {
+		r = uring_open(URING_ENTRIES);
+		if(!r) {
+			pthread_mutex_lock(&d->rings_lock);
+			d->nrings--;
+			pthread_mutex_unlock(&d->rings_lock);
+		}
+	}
+	return r;
+}
+
+static void ring_put( disk_t *d, struct uring *r )
+{
+	pthread_mutex_lock(&d->rings_lock);
+	d->rings[d->nfree++] = r;
+	pthread_mutex_unlock(&d->rings_lock);
+}
+
+// Have a batch of requests in flight at once. Without a free ring, or
+// after a failure, they are made again one at a time.
+static int ring_io( disk_t *d, int write, const struct uring_io *ios, int count )
+{
+	struct uring *r = 0;
+	int i, aligned = 1;
+
+	for(i=0;i<count;i++) {
+		if((uintptr_t)ios[i].data%DISK_BLOCK_SIZE) aligned = 0;
+	}
+	if(aligned || !d->direct) r = ring_get(d);
+	if(r) {
+		if(uring_rw(r,d->fd,write,ios,count)) {
+			ring_put(d,r);
+			return 1;
+		}
+		uring_close(r);
+		pthread_mutex_lock(&d->rings_lock);
+		d->nrings--;
+		pthread_mutex_unlock(&d->rings_lock);
+	}
+
+	for(i=0;i<count;i++) {
+		if(!direct_io(d,write,ios[i].offset/DISK_BLOCK_SIZE,ios[i].length/DISK_BLOCK_SIZE,ios[i].data)) return 0;
+	}
+	return 1;
+}
+
+// Move count blocks between data and the image
+static int transfer( disk_t *d, int write, int blocknum, int count, char *data )
+{
+	size_t offset = (size_t)blocknum*DISK_BLOCK_SIZE, length = (size_t)count*DISK_BLOCK_SIZE;
+
+	switch(d->backend) {
+		case DISK_STDIO:
+			fseek(d->file,(long)offset,SEEK_SET);
+			if(write) return fwrite(data,DISK_BLOCK_SIZE,count,d->file)==count;
+			return fread(data,DISK_BLOCK_SIZE,count,d->file)==count;
+		case DISK_MMAP:
+			if(write) memcpy(d->map+offset,data,length);
+			else memcpy(data,d->map+offset,length);
+			return 1;
+		case DISK_URING: {
+			struct uring_io io = {data,offset,length};
+			return ring_io(d,write,&io,1);
+		}
+		default:
+			return direct_io(d,write,blocknum,count,data);
+	}
+}
+
+// Up to a ring's worth of scattered blocks at a time
+static int transfer_batch( disk_t *d, int write, const int *blocknums, int count, char *const *data )
+{
+	struct uring_io ios[URING_ENTRIES];
+	int i, n;
+
+	if(d->backend!=DISK_URING) {
+		for(i=0;i<count;i++) {
+			if(!transfer(d,write,blocknums[i],1,data[i])) return 0;
+		}
+		return 1;
+	}
+	for(i=0;i<count;i+=n) {
+		for(n=0;n<URING_ENTRIES && i+n<count;n++) {
+			ios[n].data = data[i+n];
+			ios[n].offset = (off_t)blocknums[i+n]*DISK_BLOCK_SIZE;
+			ios[n].length = DISK_BLOCK_SIZE;
+		}
+		if(!ring_io(d,write,ios,n)) return 0;
+	}
+	return 1;
+}
+
+void disk_read( disk_t *d, int blocknum, char *data )
+{
+	SPAN("disk_read",blocknum);
+	PROBE2(disk_read_start,blocknum,1);
+	sanity_check(d,blocknum,data);
+
+	if(transfer(d,0,blocknum,1,data)) {
+		__atomic_fetch_add(&d->nreads,1,__ATOMIC_RELAXED);
+		PROBE2(disk_read_done,blocknum,1);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+// Read count consecutive blocks into one buffer in a single request
+void disk_readv( disk_t *d, int blocknum, int count, char *data )
+{
+	SPAN("disk_readv",blocknum);
+	if(count<=0) return;
+	PROBE2(disk_read_start,blocknum,count);
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
+
+	if(transfer(d,0,blocknum,count,data)) {
+		__atomic_fetch_add(&d->nreads,count,__ATOMIC_RELAXED);
+		PROBE2(disk_read_done,blocknum,count);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+void disk_write( disk_t *d, int blocknum, const char *data )
 {
-	sanity_check(blocknum,data);
+	SPAN("disk_write",blocknum);
+	PROBE2(disk_write_start,blocknum,1);
+	sanity_check(d,blocknum,data);
+
+	if(transfer(d,1,blocknum,1,(char *)data)) {
+		__atomic_fetch_add(&d->nwrites,1,__ATOMIC_RELAXED);
+		PROBE2(disk_write_done,blocknum,1);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+// Write count consecutive blocks from one buffer in a single request
+void disk_writev( disk_t *d, int blocknum, int count, const char *data )
+{
+	SPAN("disk_writev",blocknum);
+	if(count<=0) return;
+	PROBE2(disk_write_start,blocknum,count);
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	if(transfer(d,1,blocknum,count,(char *)data)) {
+		__atomic_fetch_add(&d->nwrites,count,__ATOMIC_RELAXED);
+		PROBE2(disk_write_done,blocknum,count);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
 }
 
-void disk_write( int blocknum, const char *data )
+// Read count blocks from anywhere on the disk, each into its own buffer.
+// An io_uring disk has them all in flight at once; the others read them
+// in turn.
+void disk_read_batch( disk_t *d, const int *blocknums, int count, char *const *data )
 {
-	sanity_check(blocknum,data);
+	int i;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	SPAN("disk_read_batch",count);
+	PROBE1(disk_read_batch_start,count);
+	for(i=0;i<count;i++) sanity_check(d,blocknums[i],data[i]);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(transfer_batch(d,0,blocknums,count,data)) {
+		__atomic_fetch_add(&d->nreads,count,__ATOMIC_RELAXED);
+		PROBE1(disk_read_batch_done,count);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
 }
 
-void disk_close()
+void disk_write_batch( disk_t *d, const int *blocknums, int count, char *const *data )
 {
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+	int i;
+
+	SPAN("disk_write_batch",count);
+	PROBE1(disk_write_batch_start,count);
+	for(i=0;i<count;i++) sanity_check(d,blocknums[i],data[i]);
+
+	if(transfer_batch(d,1,blocknums,count,data)) {
+		__atomic_fetch_add(&d->nwrites,count,__ATOMIC_RELAXED);
+		PROBE1(disk_write_batch_done,count);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+// Grow or shrink the image to n blocks
+int disk_resize( disk_t *d, int n )
+{
+	if(n<=0) return 0;
+
+	if(d->file) fflush(d->file);
+	if(d->map) {
+		munmap(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE);
+		d->map = 0;
+	}
+	int ok = ftruncate(d->fd,(off_t)n*DISK_BLOCK_SIZE)==0;
+	if(ok) d->nblocks = n;
+
+	if(d->backend==DISK_MMAP) {
+		d->map = mmap(0,(size_t)d->nblocks*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+		if(d->map==MAP_FAILED) {
+			d->map = 0;
+			d->backend = DISK_PREAD;
+		}
+	}
+	return ok;
+}
+
+// Release the host storage behind a range of blocks; they read back as zeros.
+// Returns 0 where the host file system cannot punch holes.
+int disk_discard( disk_t *d, int blocknum, int count )
+{
+	SPAN("disk_discard",blocknum);
+	if(count<=0) return 1;
+	sanity_check(d,blocknum,d);
+	sanity_check(d,blocknum+count-1,d);
+
+	if(d->file) fflush(d->file);
+	if(fallocate(d->fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE)<0) {
+		return 0;
 	}
+
+	d->ndiscards += count;
+	PROBE2(disk_discard,blocknum,count);
+	return 1;
 }
 
+// Make every block written so far durable on the host. Safe to call
+// alongside reads and writes from other threads.
+int disk_sync( disk_t *d )
+{
+	SPAN("disk_sync",-1);
+	PROBE0(disk_sync_start);
+	if(d->file && fflush(d->file)!=0) return 0;
+	if(d->map && msync(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE,MS_SYNC)<0) return 0;
+	if(fdatasync(d->fd)<0) return 0;
+
+	__atomic_fetch_add(&d->nsyncs,1,__ATOMIC_RELAXED);
+	PROBE0(disk_sync_done);
+	return 1;
+}
+
+void disk_stats( disk_t *d, struct disk_stats *s )
+{
+	s->reads = d->nreads;
+	s->writes = d->nwrites;
+	s->discards = d->ndiscards;
+	s->syncs = __atomic_load_n(&d->nsyncs,__ATOMIC_RELAXED);
+}
+
+// Close without printing the counts, for callers with output of their own
+void disk_close_quiet( disk_t *d )
+{
+	if(!d) return;
+	while(d->nfree>0) uring_close(d->rings[--d->nfree]);
+	pthread_mutex_destroy(&d->rings_lock);
+	if(d->map) munmap(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE);
+	if(d->file) {
+		fclose(d->file);
+	} else {
+		close(d->fd);
+	}
+	free(d);
+}
+
+void disk_close( disk_t *d )
+{
+	if(!d) return;
+	printf("%d disk block reads\n",d->nreads);
+	printf("%d disk block writes\n",d->nwrites);
+	printf("%d disk block discards\n",d->ndiscards);
+	printf("%d disk syncs\n",d->nsyncs);
+	disk_close_quiet(d);
+}
@@ -3,11 +3,54 @@
 
 #define DISK_BLOCK_SIZE 4096
 
-int  disk_init( const char *filename, int nblocks );
-int  disk_size();
-void disk_read( int blocknum, char *data );
-void disk_write( int blocknum, const char *data );
-void disk_close();
+// An emulated disk is one image file. Every call takes the disk it works
+// on, so a process may have any number of them open.
+
+typedef struct disk disk_t;
+
+// Blocks moved and requests made since the disk was opened
+struct disk_stats {
+	long long reads;
+	long long writes;
+	long long discards;
+	long long syncs;
+};
+
+// How blocks get to the image file. STDIO goes through a stdio stream and
+// the host page cache. PREAD issues one system call per request. DIRECT
+// opens the image with O_DIRECT so blocks bypass the host page cache;
+// buffers must then be DISK_BLOCK_SIZE aligned, which every pool buffer
+// is, and any other buffer is copied through one. Where the host file
+// system refuses O_DIRECT the disk falls back to PREAD. MMAP maps the
+// image and copies blocks in and out of the mapping. URING submits
+// through io_uring with O_DIRECT where the host allows it, and keeps a
+// whole batch in flight; without io_uring it falls back to DIRECT.
+enum disk_backend {
+	DISK_STDIO,
+	DISK_PREAD,
+	DISK_DIRECT,
+	DISK_MMAP,
+	DISK_URING,
+	DISK_BACKENDS // how many there are
+};
+
+disk_t *disk_open( const char *filename, int nblocks );
+disk_t *disk_open_backend( const char *filename, int nblocks, enum disk_backend backend );
+enum disk_backend disk_backend( disk_t *d );
+const char *disk_backend_name( enum disk_backend backend );
+int     disk_size( disk_t *d );
+int     disk_resize( disk_t *d, int n );
+void    disk_read( disk_t *d, int blocknum, char *data );
+void    disk_readv( disk_t *d, int blocknum, int count, char *data );
+void    disk_write( disk_t *d, int blocknum, const char *data );
+void    disk_writev( disk_t *d, int blocknum, int count, const char *data );
+void    disk_read_batch( disk_t *d, const int *blocknums, int count, char *const *data );
+void    disk_write_batch( disk_t *d, const int *blocknums, int count, char *const *data );
+int     disk_discard( disk_t *d, int blocknum, int count );
+int     disk_sync( disk_t *d );
+void    disk_stats( disk_t *d, struct disk_stats *s );
+void    disk_close( disk_t *d );
+void    disk_close_quiet( disk_t *d );
 
 
 #endif
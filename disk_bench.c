@@ -0,0 +1,357 @@
+
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each disk backend against the same scratch image, one cell of the matrix
+// at a time:
+//
+//	pattern     seqread, seqwrite, randread or randwrite
+//	depth       threads issuing requests at once, each with its own
+//	            share of the image for sequential runs
+//	batch       blocks per call: one disk_readv or disk_writev over
+//	            consecutive blocks, or one disk_read_batch or
+//	            disk_write_batch over scattered ones
+//
+// The host page cache is dropped for the image before every cell, and
+// write cells include the disk_sync that makes them durable. A backend the
+// host cannot give us (no io_uring, or no O_DIRECT) falls back to another
+// one; its cells are reported as skipped rather than timed twice.
+//
+// The stdio backend shares one stream between threads, which cannot seek
+// and transfer as one step, so it runs at depth 1 only; its deeper cells
+// are left out of the table, with a line saying so.
+
+#define MAX_DEPTHS 8
+#define MAX_BATCH  256
+
+enum pattern { SEQREAD, SEQWRITE, RANDREAD, RANDWRITE, NPATTERNS };
+
+static const char *pattern_names[NPATTERNS] = {"seqread","seqwrite","randread","randwrite"};
+
+struct worker {
+	pthread_t thread;
+	unsigned long long rng;
+	int first;  // its share of the image
+	int count;
+	int cursor;
+	char *buffer;
+	char *blocks[MAX_BATCH];
+	int blocknums[MAX_BATCH];
+	long long calls;
+	long long nblocks;
+};
+
+struct cell {
+	enum disk_backend backend;
+	enum pattern pattern;
+	int depth;
+	int batch;
+	int skipped;
+	double mbps;
+	double iops;
+	double latency_us; // per call
+};
+
+static disk_t *disk;
+static enum pattern pattern;
+static int batch;
+static volatile int stop;
+
+static unsigned long long next_random( struct worker *w )
+{
+	w->rng ^= w->rng>>12;
+	w->rng ^= w->rng<<25;
+	w->rng ^= w->rng>>27;
+	return w->rng*2685821657736338717ULL;
+}
+
+static double now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e6 + t.tv_nsec/1e3;
+}
+
+static void step( struct worker *w )
+{
+	int i, size = disk_size(disk);
+
+	switch(pattern) {
+		case SEQREAD:
+		case SEQWRITE:
+			if(w->cursor+batch>w->first+w->count) w->cursor = w->first;
+			if(pattern==SEQREAD) {
+				disk_readv(disk,w->cursor,batch,w->buffer);
+			} else {
+				disk_writev(disk,w->cursor,batch,w->buffer);
+			}
+			w->cursor += batch;
+			break;
+		case RANDREAD:
+		case RANDWRITE:
+			for(i=0;i<batch;i++) w->blocknums[i] = next_random(w)%size;
+			if(pattern==RANDREAD) {
+				disk_read_batch(disk,w->blocknums,batch,w->blocks);
+			} else {
+				disk_write_batch(disk,w->blocknums,batch,w->blocks);
+			}
+			break;
+		default:
+			break;
+	}
+	w->calls++;
+	w->nblocks += batch;
+}
+
+static void *worker( void *arg )
+{
+	struct worker *w = arg;
+	while(!stop) step(w);
+	return 0;
+}
+
+// Write the image back and forget it, so reads come from the device
+static void drop_cache( const char *image )
+{
+	int fd = open(image,O_RDWR);
+	if(fd<0) return;
+	fdatasync(fd);
+	posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+// Fill the image, so that reads past what was written still hit real blocks
+static int prefill( const char *image, int nblocks )
+{
+	disk_t *d = disk_open_backend(image,nblocks,DISK_PREAD);
+	char *buffer;
+	int b, i, n;
+
+	if(!d || posix_memalign((void **)&buffer,DISK_BLOCK_SIZE,MAX_BATCH*DISK_BLOCK_SIZE)) return 0;
+	for(i=0;i<MAX_BATCH*DISK_BLOCK_SIZE;i++) buffer[i] = i*7;
+	for(b=0;b<nblocks;b+=n) {
+		n = nblocks-b<MAX_BATCH ? nblocks-b : MAX_BATCH;
+		disk_writev(d,b,n,buffer);
+	}
+	disk_sync(d);
+	disk_close_quiet(d);
+	free(buffer);
+	return 1;
+}
+
+static int run_cell( const char *image, struct cell *c, struct worker *workers, int ms )
+{
+	int i;
+
+	pattern = c->pattern;
+	batch = c->batch;
+	stop = 0;
+	for(i=0;i<c->depth;i++) {
+		struct worker *w = &workers[i];
+		w->rng = 0x9e3779b97f4a7c15ULL*(i+1);
+		w->first = (long long)disk_size(disk)*i/c->depth;
+		w->count = (long long)disk_size(disk)*(i+1)/c->depth - w->first;
+		w->cursor = w->first;
+		w->calls = w->nblocks = 0;
+		if(w->count<batch) return 0;
+	}
+
+	drop_cache(image);
+	double start = now_us();
+	for(i=0;i<c->depth;i++) pthread_create(&workers[i].thread,0,worker,&workers[i]);
+	usleep(ms*1000);
+	stop = 1;
+	for(i=0;i<c->depth;i++) pthread_join(workers[i].thread,0);
+	if(c->pattern==SEQWRITE || c->pattern==RANDWRITE) disk_sync(disk);
+	double elapsed = now_us()-start;
+
+	long long calls = 0, nblocks = 0;
+	for(i=0;i<c->depth;i++) {
+		calls += workers[i].calls;
+		nblocks += workers[i].nblocks;
+	}
+	c->iops = nblocks/(elapsed/1e6);
+	c->mbps = c->iops*DISK_BLOCK_SIZE/(1024.0*1024.0);
+	c->latency_us = calls ? elapsed*c->depth/calls : 0;
+	return 1;
+}
+
+static int parse_list( const char *text, int *list, int max )
+{
+	int n = 0;
+	char *copy = strdup(text), *save = 0, *item;
+
+	for(item=strtok_r(copy,",",&save);item && n<max;item=strtok_r(0,",",&save)) {
+		list[n] = atoi(item);
+		if(list[n]<=0) {
+			free(copy);
+			return 0;
+		}
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+static void write_json( const char *filename, struct cell *cells, int ncells, int nblocks, int ms )
+{
+	FILE *file = fopen(filename,"w");
+	int i;
+
+	if(!file) {
+		printf("couldn't write %s\n",filename);
+		return;
+	}
+	fprintf(file,"{\n  \"block_size\": %d,\n  \"blocks\": %d,\n  \"duration_ms\": %d,\n  \"cells\": [\n",DISK_BLOCK_SIZE,nblocks,ms);
+	for(i=0;i<ncells;i++) {
+		struct cell *c = &cells[i];
+		fprintf(file,"    {\"backend\": \"%s\", \"pattern\": \"%s\", \"depth\": %d, \"batch\": %d, ",
+			disk_backend_name(c->backend),pattern_names[c->pattern],c->depth,c->batch);
+		if(c->skipped) {
+			fprintf(file,"\"skipped\": true}");
+		} else {
+			fprintf(file,"\"mb_per_s\": %.1f, \"iops\": %.0f, \"latency_us\": %.1f}",c->mbps,c->iops,c->latency_us);
+		}
+		fprintf(file,"%s\n",i<ncells-1 ? "," : "");
+	}
+	fprintf(file,"  ]\n}\n");
+	fclose(file);
+}
+
+static void usage( const char *name )
+{
+	printf("use: %s [options]\n",name);
+	printf("    -b <backends>      comma separated (pread,mmap,direct,uring,stdio)\n");
+	printf("    -q <depths>        threads at once, comma separated (1,4,16)\n");
+	printf("    -s <batches>       blocks per call, comma separated (1,8,32)\n");
+	printf("    -d <ms>            time per cell (200)\n");
+	printf("    -n <blocks>        size of the scratch image (65536)\n");
+	printf("    -o <file>          where the scratch image goes (disk_bench.img)\n");
+	printf("    -j <file>          also write the results as JSON\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *backend_list = "pread,mmap,direct,uring,stdio";
+	const char *image = "disk_bench.img", *json = 0;
+	int depths[MAX_DEPTHS] = {1,4,16}, ndepths = 3;
+	int batches[MAX_DEPTHS] = {1,8,32}, nbatches = 3;
+	enum disk_backend backends[DISK_BACKENDS];
+	int nbackends = 0, ms = 200, nblocks = 65536, maxdepth = 0;
+	struct cell *cells;
+	struct worker *workers;
+	int i, j, c, b, p, q, s, ncells = 0;
+
+	while((c = getopt(argc,argv,"b:q:s:d:n:o:j:"))!=-1) {
+		switch(c) {
+			case 'b': backend_list = optarg; break;
+			case 'q': ndepths = parse_list(optarg,depths,MAX_DEPTHS); break;
+			case 's': nbatches = parse_list(optarg,batches,MAX_DEPTHS); break;
+			case 'd': ms = atoi(optarg); break;
+			case 'n': nblocks = atoi(optarg); break;
+			case 'o': image = optarg; break;
+			case 'j': json = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(optind!=argc || ndepths<=0 || nbatches<=0 || ms<=0 || nblocks<=0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	char *copy = strdup(backend_list), *save = 0, *item;
+	for(item=strtok_r(copy,",",&save);item;item=strtok_r(0,",",&save)) {
+		for(b=0;b<DISK_BACKENDS;b++) {
+			if(!strcmp(item,disk_backend_name(b))) break;
+		}
+		if(b==DISK_BACKENDS || nbackends==DISK_BACKENDS) {
+			usage(argv[0]);
+			return 1;
+		}
+		backends[nbackends++] = b;
+	}
+	free(copy);
+	for(i=0;i<nbatches;i++) {
+		if(batches[i]>MAX_BATCH) {
+			printf("batches are at most %d blocks\n",MAX_BATCH);
+			return 1;
+		}
+	}
+	for(i=0;i<ndepths;i++) {
+		if(depths[i]>maxdepth) maxdepth = depths[i];
+	}
+
+	cells = calloc(nbackends*NPATTERNS*ndepths*nbatches,sizeof(struct cell));
+	workers = calloc(maxdepth,sizeof(struct worker));
+	if(!cells || !workers) {
+		printf("out of memory\n");
+		return 1;
+	}
+	for(i=0;i<maxdepth;i++) {
+		struct worker *w = &workers[i];
+		if(posix_memalign((void **)&w->buffer,DISK_BLOCK_SIZE,MAX_BATCH*DISK_BLOCK_SIZE)) {
+			printf("out of memory\n");
+			return 1;
+		}
+		memset(w->buffer,i+1,MAX_BATCH*DISK_BLOCK_SIZE);
+		for(j=0;j<MAX_BATCH;j++) w->blocks[j] = w->buffer+j*DISK_BLOCK_SIZE;
+	}
+
+	unlink(image);
+	if(!prefill(image,nblocks)) {
+		printf("couldn't create %s\n",image);
+		return 1;
+	}
+
+	printf("%d blocks of %d bytes, %d ms per cell\n\n",nblocks,DISK_BLOCK_SIZE,ms);
+	printf("%-8s %-10s %6s %6s %10s %10s %12s\n","backend","pattern","depth","batch","MB/s","IOPS","us/call");
+
+	for(b=0;b<nbackends;b++) {
+		disk = disk_open_backend(image,nblocks,backends[b]);
+		if(!disk) {
+			printf("couldn't open %s\n",image);
+			return 1;
+		}
+		int fell_back = disk_backend(disk)!=backends[b];
+		if(fell_back) {
+			printf("%-8s skipped: the host gave the %s backend instead\n",
+				disk_backend_name(backends[b]),disk_backend_name(disk_backend(disk)));
+		} else if(backends[b]==DISK_STDIO && maxdepth>1) {
+			printf("%-8s depth 1 only: its one stream cannot seek and transfer as one step\n",disk_backend_name(backends[b]));
+		}
+		for(p=0;p<NPATTERNS;p++) {
+			for(q=0;q<ndepths;q++) {
+				for(s=0;s<nbatches;s++) {
+					struct cell *cell = &cells[ncells++];
+					cell->backend = backends[b];
+					cell->pattern = p;
+					cell->depth = depths[q];
+					cell->batch = batches[s];
+					cell->skipped = fell_back || (backends[b]==DISK_STDIO && depths[q]>1);
+					if(cell->skipped) continue;
+					if(!run_cell(image,cell,workers,ms)) {
+						cell->skipped = 1;
+						printf("%-8s %-10s %6d %6d skipped: a thread's share of the image is under one batch\n",
+							disk_backend_name(cell->backend),pattern_names[p],cell->depth,cell->batch);
+					} else {
+						printf("%-8s %-10s %6d %6d %10.1f %10.0f %12.1f\n",disk_backend_name(cell->backend),
+							pattern_names[p],cell->depth,cell->batch,cell->mbps,cell->iops,cell->latency_us);
+					}
+					fflush(stdout);
+				}
+			}
+		}
+		disk_close_quiet(disk);
+	}
+
+	if(json) write_json(json,cells,ncells,nblocks,ms);
+	unlink(image);
+	return 0;
+}
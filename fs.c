@@ -1,6 +1,18 @@
 
+#define _GNU_SOURCE
+
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "layout.h"
+#include "pool.h"
+#include "bitmap.h"
+#include "scan.h"
+#include "itable.h"
+#include "alloc.h"
+#include "intent.h"
+#include "span.h"
+#include "probe.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -9,154 +21,1267 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
 
-// Constants
-
-#define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
-#define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
-
-// Global Variables
+// Instance State
 
-bool is_mounted = false;
-bool *free_block_bm;
+// Freed blocks waiting to be discarded, as runs of consecutive blocks
+#define DISCARD_RANGES 256
+struct discard_range {
+	int start;
+	int count;
+};
 
-// Data Structures
+// Deleted inodes whose blocks are still to be freed. Each one stays on
+// disk, marked FS_INODE_ORPHAN, until the reclaimer is done with it.
+struct orphan {
+	int inumber;
+	int next;       // next pointer to free: direct ones, then indirect ones
+	int remaining;  // blocks left to free, not counting the indirect block
+	struct fs_inode inode;
+};
 
-struct fs_superblock {
-	int magic;
-	int nblocks;
-	int ninodeblocks;
-	int ninodes;
+// Access hints from fs_advise, for one byte range of a file. end 0 runs
+// to the end of the file.
+#define ADVICE_SLOTS 64
+struct advice {
+	int inumber; // 0 for a free slot
+	int hints;
+	int start;
+	int end;
+	int next;    // block a sequential reader is expected to ask for next
+	int ahead;   // blocks before this one have been read ahead
+	int window;  // blocks to read ahead of the reader
+	long long used;
 };
 
-struct fs_inode {
-	int isvalid;
-	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
+// Group commit: a durability call takes a ticket once its blocks are
+// written, and one disk sync covers every ticket taken before it started.
+// The last failed sync covered tickets fail_lo to fail_hi.
+struct sync_group {
+	long long ticket;
+	long long done;
+	bool running;
+	int last_group;
+	long long fail_lo;
+	long long fail_hi;
+	long long flushes;
+	pthread_cond_t cond;
 };
 
-union fs_block {
-	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	char data[DISK_BLOCK_SIZE];
+// Everything one file system instance knows. Nothing is shared between
+// instances, so one process may have any number of them mounted.
+struct fs {
+	disk_t *disk;
+	cache_t *cache;
+
+	// Every API call holds the lock, and so do the background threads
+	// while they work. It is recursive so API calls may nest.
+	pthread_mutex_t lock;
+
+	bool is_mounted;
+	uint64_t *free_block_bm;
+	struct alloc block_alloc; // hands out the data blocks of free_block_bm
+	struct fs_superblock mounted_super;
+	struct itable inode_table;
+
+	// Inode tables up to this many blocks are pinned in the cache at mount
+	int pin_limit;
+
+	struct discard_range discard_queue[DISCARD_RANGES];
+	int discard_pending;
+
+	// Hints for the files advised most recently
+	struct advice advice[ADVICE_SLOTS];
+	long long advice_clock;
+
+	struct orphan *orphans;
+	int norphans;
+	int orphans_max;
+	pthread_cond_t reclaim_wake;
+	bool reclaimer_started;
+
+	// Write-back: data blocks dirty for dirty_expire ms are written out by
+	// the flusher, and writers are slowed as the dirty blocks approach
+	// dirty_ratio percent of the data cache. An expiry of 0 writes through.
+	int dirty_expire;
+	int dirty_ratio;
+	pthread_cond_t flush_wake;
+	bool flusher_started;
+
+	// Group commit on the image, and on the intent log if there is one
+	struct sync_group sync_main;
+	struct sync_group sync_intent;
+	long long sync_calls;
+
+	// Synchronous writes are recorded in the intent log and reach the image
+	// later; a checkpoint makes the image durable and empties the log
+	intent_t *intent;
+	long long intent_writes;
+	long long intent_checkpoints;
+	int intent_skipped; // records replay found no file for
+
+	// Creates so far, and how many of them a sync of the image covers; the
+	// intent log only holds data, so it relies on the image for the inode
+	long long creates;
+	long long creates_synced;
+
+	// Mount scan progress: blocks of the inode table below scan_next are in
+	// the inode table in memory and the free block bitmap. Only a lazy mount
+	// returns before scan_next reaches scan_end.
+	int scan_next;
+	int scan_end;
+	int scan_generation;
+	pthread_cond_t scan_done;
+
+	// Log-structured mode: where each inode block currently lives, the
+	// segment being filled and when each segment was last written
+	int *imap;
+	uint64_t *imap_dirty;
+	int *segment_seq;
+	char *log_buffer;
+	int log_start;
+	int log_used;
+	int log_room; // free slots left, a lower bound between rescans
+
+	// The cleaner keeps LOG_CLEAN_AHEAD slots free in the background, and is
+	// woken at most once per segment the log moves on to
+	pthread_cond_t clean_wake;
+	bool clean_wanted;
+	int clean_seq;
+	bool cleaner_started;
+
+	// Background threads still running; fs_close waits for them to go
+	int threads;
+	bool closing;
+	pthread_cond_t threads_done;
 };
 
+pthread_mutex_t *fs_lock_acquire( fs_t *fs ){
+	SPAN("lock_wait", -1);
+	pthread_mutex_lock(&fs->lock);
+	return &fs->lock;
+}
+
+void fs_lock_release( pthread_mutex_t **lock ){
+	pthread_mutex_unlock(*lock);
+}
+
+// Hold the instance lock until the enclosing scope is left, on every return path
+#define FS_LOCKED pthread_mutex_t *fs_held __attribute__((cleanup(fs_lock_release))) = fs_lock_acquire(fs)
+
+// Leave a call of the fs.h API through its return probe, which carries the
+// result; the call's entry probe carries its arguments
+#define FS_RETURN(name, result) do{ __typeof__(result) fs_result = (result); PROBE1(name##_return, fs_result); return fs_result; }while(0)
+
 // Low Level Functions (Helpers)
 
-void inode_load( int inumber, struct fs_inode *inode ) {
-	int block_number = 1 + floor(inumber / INODES_PER_BLOCK);
+// Number of inode blocks that have ever been written; the rest of the
+// table has not been initialized and reads as empty
+int inode_blocks_initialized( struct fs_superblock *super ){
+	if(super->features & FS_FEATURE_LAZY_ITABLE) return super->inode_watermark;
+	return super->ninodeblocks;
+}
+
+bool log_mode( fs_t *fs ){
+	return fs->mounted_super.features & FS_FEATURE_LOG;
+}
+
+// In log mode, whether a block is still in the segment being filled
+bool log_buffered( fs_t *fs, int blocknum ){
+	return fs->log_start && blocknum > fs->log_start && blocknum < fs->log_start + fs->log_used;
+}
+
+// Blocks still sitting in the segment buffer are read from there
+void block_read( fs_t *fs, int blocknum, char *data, int kind ){
+	if(log_buffered(fs, blocknum)){
+		memcpy(data, fs->log_buffer + (blocknum - fs->log_start) * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+		return;
+	}
+	cache_read(fs->cache, blocknum, data, kind);
+}
+
+void super_save( fs_t *fs ){
+	union fs_block *block POOL_SCOPED = pool_get();
+	memset(block->data, 0, DISK_BLOCK_SIZE);
+	block->super = fs->mounted_super;
+	cache_write(fs->cache, 0, block->data, CACHE_META);
+}
+
+// Log-Structured Mode
+
+int log_data_start( struct fs_superblock *super ){
+	return 1 + super->imap_blocks;
+}
+
+int log_nsegments( struct fs_superblock *super ){
+	return (super->nblocks - log_data_start(super)) / SEGMENT_BLOCKS;
+}
+
+int segment_first( fs_t *fs, int segment ){
+	return log_data_start(&fs->mounted_super) + segment * SEGMENT_BLOCKS;
+}
+
+// Live blocks in a segment, not counting its summary
+int segment_live( fs_t *fs, int segment ){
+	int first = segment_first(fs, segment), live = 0, b;
+	for(b = first + 1; b < first + SEGMENT_BLOCKS; b++){
+		if(!bitmap_test(fs->free_block_bm, b)) live++;
+	}
+	return live;
+}
+
+// Write the segment being filled, summary included, in one request
+void log_flush( fs_t *fs ){
+	SPAN("log_flush", -1);
+	if(!fs->log_start) return;
+	cache_writev(fs->cache, fs->log_start, fs->log_used, fs->log_buffer);
+}
+
+// Make the disk self-contained: the segment, then the inode map blocks
+// that changed, then the superblock
+void log_checkpoint( fs_t *fs ){
+	SPAN("log_checkpoint", -1);
+	log_flush(fs);
+
+	union fs_block *block POOL_SCOPED = pool_get();
+	int i;
+	for(i = 0; i < fs->mounted_super.imap_blocks; i++){
+		if(!bitmap_test(fs->imap_dirty, i)) continue;
+		memcpy(block->pointers, fs->imap + i * POINTERS_PER_BLOCK, DISK_BLOCK_SIZE);
+		cache_write(fs->cache, 1 + i, block->data, CACHE_META);
+		bitmap_clear(fs->imap_dirty, i);
+	}
+	super_save(fs);
+}
+
+// Start filling the next clean segment. Checkpointing first means no block
+// freed so far is referenced from disk any more, so all of them may be reused.
+bool log_next_segment( fs_t *fs ){
+	log_checkpoint(fs);
+
+	int nsegments = log_nsegments(&fs->mounted_super);
+	int current = fs->log_start ? (fs->log_start - log_data_start(&fs->mounted_super)) / SEGMENT_BLOCKS : -1;
+	int i;
+	for(i = 1; i <= nsegments; i++){
+		int segment = (current + i) % nsegments;
+		if(segment == current || segment_live(fs, segment) > 0) continue;
+
+		fs->log_start = segment_first(fs, segment);
+		fs->log_used = 1;
+		fs->mounted_super.log_seq++;
+		fs->segment_seq[segment] = fs->mounted_super.log_seq;
+
+		union fs_block *summary = (union fs_block *)fs->log_buffer;
+		memset(summary->data, 0, DISK_BLOCK_SIZE);
+		summary->summary.seq = fs->mounted_super.log_seq;
+		int slot;
+		for(slot = 0; slot < SEGMENT_BLOCKS; slot++){
+			summary->summary.entry[slot].lblock = SUMMARY_FREE;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Append one block to the log and return where it went, or 0 if the log is full
+int log_append( fs_t *fs, const char *data, int inumber, int lblock ){
+	if(!fs->log_start || fs->log_used == SEGMENT_BLOCKS){
+		if(!log_next_segment(fs)) return 0;
+	}
+
+	int blocknum = fs->log_start + fs->log_used;
+	memcpy(fs->log_buffer + fs->log_used * DISK_BLOCK_SIZE, data, DISK_BLOCK_SIZE);
+	union fs_block *summary = (union fs_block *)fs->log_buffer;
+	summary->summary.entry[fs->log_used].inumber = inumber;
+	summary->summary.entry[fs->log_used].lblock = lblock;
+	bitmap_clear(fs->free_block_bm, blocknum);
+	fs->log_used++;
+	fs->log_room--;
+	PROBE3(log_append, inumber, lblock, blocknum);
+	return blocknum;
+}
+
+// Metadata appends cannot fail half way through an operation;
+// log_make_room holds back enough space for them
+int log_append_meta( fs_t *fs, const char *data, int inumber, int lblock ){
+	int blocknum = log_append(fs, data, inumber, lblock);
+	if(!blocknum){
+		printf("ERROR: log is full!\n");
+		abort();
+	}
+	return blocknum;
+}
+
+// Append a new copy of an inode table block and point the inode map at it
+void log_inode_block_append( fs_t *fs, int index, const char *data ){
+	int location = log_append_meta(fs, data, index, SUMMARY_INODES);
+	if(fs->imap[index]) alloc_free(&fs->block_alloc, fs->imap[index]);
+	fs->imap[index] = location;
+	bitmap_set(fs->imap_dirty, index / POINTERS_PER_BLOCK);
+}
+
+// Load a block of the inode table; blocks never written read as empty
+void inode_block_load( fs_t *fs, int index, union fs_block *block ){
+	SPAN("inode_block_load", index);
+	int location = 0;
+	if(log_mode(fs)){
+		location = fs->imap[index];
+	}else if(index < inode_blocks_initialized(&fs->mounted_super)){
+		location = index + 1;
+	}
+
+	if(location){
+		block_read(fs, location, block->data, CACHE_META);
+	}else{
+		memset(block->data, 0, DISK_BLOCK_SIZE);
+	}
+}
+
+void inode_load( fs_t *fs, int inumber, struct fs_inode *inode ) {
+	SPAN("inode_load", inumber);
+	// Valid inodes of a mounted file system are all in the inode table
+	if(fs->is_mounted && itable_valid(&fs->inode_table, inumber)){
+		itable_get(&fs->inode_table, inumber, inode);
+		return;
+	}
+
+	int block_index = inumber / INODES_PER_BLOCK;
 	int block_inode = inumber % INODES_PER_BLOCK;
 
 	// Load the block containing the inode
-	union fs_block block;
-	disk_read(block_number, block.data);
+	union fs_block *block POOL_SCOPED = pool_get();
+	inode_block_load(fs, block_index, block);
 
 	// Get the inode of interest
-	*inode = block.inode[block_inode];
+	*inode = block->inode[block_inode];
 	return;
 }
 
-void inode_save( int inumber, struct fs_inode *inode ) {
-	int block_number = 1 + floor(inumber / INODES_PER_BLOCK);
+// Write back a whole block of the inode table
+void inode_block_store( fs_t *fs, int index, union fs_block *block ){
+	SPAN("inode_block_store", index);
+	// In log mode the block moves to the head of the log
+	if(log_mode(fs)){
+		log_inode_block_append(fs, index, block->data);
+		return;
+	}
+
+	// First use of this part of the table: zero the untouched blocks
+	// below it so everything under the watermark is real
+	int initialized = inode_blocks_initialized(&fs->mounted_super);
+	if(index > initialized){
+		union fs_block *zero POOL_SCOPED = pool_get();
+		memset(zero->data, 0, DISK_BLOCK_SIZE);
+		int b;
+		for(b = initialized; b < index; b++){
+			cache_write(fs->cache, b + 1, zero->data, CACHE_META);
+		}
+	}
+	cache_write(fs->cache, index + 1, block->data, CACHE_META);
+
+	// Raise the watermark only once the blocks under it are on disk
+	if(index >= initialized){
+		fs->mounted_super.inode_watermark = index + 1;
+		super_save(fs);
+	}
+}
+
+void inode_save( fs_t *fs, int inumber, struct fs_inode *inode ) {
+	SPAN("inode_save", inumber);
+	int block_index = inumber / INODES_PER_BLOCK;
 	int block_inode = inumber % INODES_PER_BLOCK;
 
 	// Load the block containing the inode
-	union fs_block block;
-	disk_read(block_number, block.data);
+	union fs_block *block POOL_SCOPED = pool_get();
+	inode_block_load(fs, block_index, block);
 
 	// Write the new inode
-	block.inode[block_inode] = *inode;
-	disk_write(block_number, block.data);
+	block->inode[block_inode] = *inode;
+	inode_block_store(fs, block_index, block);
+	itable_set(&fs->inode_table, inumber, inode);
 }
 
-bool is_valid_inumber( int inumber ){
-	// Load the super block
-	union fs_block super_block;
-	disk_read(0, super_block.data);
+// Save a batch of inodes sorted by inumber, writing each inode block once
+void inode_save_many( fs_t *fs, const int *inumbers, const struct fs_inode *inodes, int count ){
+	SPAN("inode_save_many", count);
+	union fs_block *block POOL_SCOPED = pool_get();
+	int i = 0;
+	while(i < count){
+		int block_index = inumbers[i] / INODES_PER_BLOCK;
+		inode_block_load(fs, block_index, block);
+		for(; i < count && inumbers[i] / INODES_PER_BLOCK == block_index; i++){
+			block->inode[inumbers[i] % INODES_PER_BLOCK] = inodes[i];
+			itable_set(&fs->inode_table, inumbers[i], &inodes[i]);
+		}
+		inode_block_store(fs, block_index, block);
+	}
+}
 
-	// Check that the block number and block inode are within range
-	if(inumber > 0 && inumber < super_block.super.ninodes){
+// Whether a lazy mount has yet to scan a block of the inode table. Blocks
+// past the end of the scan were never written, so their inodes are known
+// to be free.
+bool inode_block_unscanned( fs_t *fs, int inode_block ){
+	return inode_block >= fs->scan_next && inode_block < fs->scan_end;
+}
+
+bool is_valid_inumber( fs_t *fs, int inumber ){
+	// Inodes a lazy mount has not scanned yet are looked up on disk
+	if(inumber > 0 && inumber < fs->mounted_super.ninodes && inode_block_unscanned(fs, inumber / INODES_PER_BLOCK)){
 		struct fs_inode inode;
-		inode_load(inumber, &inode);
-		// Check that the inode is valid
-		if(inode.isvalid){
-			return true;
+		inode_load(fs, inumber, &inode);
+		return inode.isvalid && inode.isvalid != FS_INODE_ORPHAN;
+	}
+
+	// The in-memory inode table answers both the range and validity checks
+	return inumber > 0 && itable_valid(&fs->inode_table, inumber);
+}
+
+// Mark every block an inode owns, data and indirect alike, as free or in use
+void inode_mark_blocks( fs_t *fs, struct fs_inode *inode, union fs_block *indirect_block, bool isfree ){
+	int remaining = ceil((double)inode->size / DISK_BLOCK_SIZE);
+
+	// Blocks pointed to by direct pointers
+	remaining -= scan_pointers(inode->direct, POINTERS_PER_INODE, remaining, fs->mounted_super.nblocks, fs->free_block_bm, isfree);
+
+	// Indirect block and the blocks pointed to by it
+	if(remaining > 0 && inode->indirect){
+		if(isfree) alloc_free(&fs->block_alloc, inode->indirect);
+		else bitmap_clear(fs->free_block_bm, inode->indirect);
+		block_read(fs, inode->indirect, indirect_block->data, CACHE_META);
+		scan_pointers(indirect_block->pointers, POINTERS_PER_BLOCK, remaining, fs->mounted_super.nblocks, fs->free_block_bm, isfree);
+	}
+}
+
+int discard_compare( const void *a, const void *b ){
+	return ((const struct discard_range *)a)->start - ((const struct discard_range *)b)->start;
+}
+
+// Sort and merge the queued runs, then punch each one out of the image
+void discard_flush( fs_t *fs ){
+	SPAN("discard_flush", -1);
+	if(fs->discard_pending == 0) return;
+	qsort(fs->discard_queue, fs->discard_pending, sizeof(struct discard_range), discard_compare);
+
+	struct discard_range run = fs->discard_queue[0];
+	int i;
+	for(i = 1; i < fs->discard_pending; i++){
+		if(fs->discard_queue[i].start <= run.start + run.count){
+			int end = fs->discard_queue[i].start + fs->discard_queue[i].count;
+			if(end > run.start + run.count) run.count = end - run.start;
 		}else{
-			return false;
+			cache_discard(fs->cache, run.start, run.count);
+			run = fs->discard_queue[i];
 		}
 	}
-	return false;
+	cache_discard(fs->cache, run.start, run.count);
+	fs->discard_pending = 0;
 }
 
-void dump_free_blocks(int nblocks){
+void discard_add( fs_t *fs, int blocknum ){
+	if(blocknum <= 0 || blocknum >= fs->mounted_super.nblocks) return;
+
+	// Extend the last run when blocks are freed in order, as they usually are
+	if(fs->discard_pending > 0){
+		struct discard_range *last = &fs->discard_queue[fs->discard_pending - 1];
+		if(last->start + last->count == blocknum){
+			last->count++;
+			return;
+		}
+	}
+	if(fs->discard_pending == DISCARD_RANGES) discard_flush(fs);
+	fs->discard_queue[fs->discard_pending].start = blocknum;
+	fs->discard_queue[fs->discard_pending].count = 1;
+	fs->discard_pending++;
+}
+
+// Hand out a free data block, or -1 if there is none
+int block_alloc( fs_t *fs ){
+	SPAN("block_alloc", -1);
+	int blocknum = alloc_block(&fs->block_alloc);
+	PROBE1(block_alloc, blocknum);
+	return blocknum;
+}
+
+void dump_free_blocks( fs_t *fs, int nblocks){
 	int i;
 	for(i = 0; i < nblocks; i++){
-		printf("%d", free_block_bm[i]);
+		printf("%d", bitmap_test(fs->free_block_bm, i));
 	}
 	printf("\n");
 }
 
-// High Level Functions
+// Log cleaning
+
+struct log_live {
+	int blocknum;
+	int inumber;
+	int lblock;
+};
+
+// Inode table blocks first, then everything else grouped by owner
+int log_live_compare( const void *a, const void *b ){
+	const struct log_live *x = a, *y = b;
+	if((x->lblock == SUMMARY_INODES) != (y->lblock == SUMMARY_INODES)){
+		return x->lblock == SUMMARY_INODES ? -1 : 1;
+	}
+	if(x->inumber != y->inumber) return x->inumber - y->inumber;
+	return x->lblock - y->lblock;
+}
+
+// Free slots in clean segments and in the one being filled
+int log_free_slots( fs_t *fs ){
+	int nsegments = log_nsegments(&fs->mounted_super), slots = 0, segment;
+	for(segment = 0; segment < nsegments; segment++){
+		if(segment_first(fs, segment) == fs->log_start) continue;
+		if(segment_live(fs, segment) == 0) slots += SEGMENT_BLOCKS - 1;
+	}
+	if(fs->log_start) slots += SEGMENT_BLOCKS - fs->log_used;
+	return slots;
+}
+
+// Cost-benefit victim selection: the free space a segment yields, weighted
+// by how long its data has gone unmodified, over the cost of copying it
+int log_pick_victim( fs_t *fs ){
+	int nsegments = log_nsegments(&fs->mounted_super), best = -1, segment;
+	double best_score = 0;
+	for(segment = 0; segment < nsegments; segment++){
+		if(segment_first(fs, segment) == fs->log_start) continue;
+		int live = segment_live(fs, segment);
+		if(live == 0 || live == SEGMENT_BLOCKS - 1) continue;
+		if(live * 3 > fs->log_room) continue; // Moving it could use up the log
+
+		double u = (double)live / (SEGMENT_BLOCKS - 1);
+		double age = fs->mounted_super.log_seq - fs->segment_seq[segment] + 1;
+		double score = (1 - u) * age / (1 + u);
+		if(score > best_score){
+			best_score = score;
+			best = segment;
+		}
+	}
+	return best;
+}
+
+// Move the live blocks one inode owns in a victim segment, then rewrite its
+// indirect block and inode once
+void log_clean_inode( fs_t *fs, int inumber, struct log_live *live, int nlive, union fs_block *block, union fs_block *indirect_block ){
+	if(!itable_valid(&fs->inode_table, inumber)) return;
+
+	struct fs_inode inode;
+	inode_load(fs, inumber, &inode);
+	bool has_indirect = inode.indirect && ceil((double)inode.size / DISK_BLOCK_SIZE) > POINTERS_PER_INODE;
+	if(has_indirect) block_read(fs, inode.indirect, indirect_block->data, CACHE_META);
+
+	bool changed = false, indirect_changed = false;
+	int i;
+	for(i = 0; i < nlive; i++){
+		if(live[i].lblock == SUMMARY_INDIRECT){
+			if(has_indirect && inode.indirect == live[i].blocknum) indirect_changed = true;
+			continue;
+		}
+
+		// Only move the block if the inode still points at it
+		int *ptr = 0;
+		if(live[i].lblock < POINTERS_PER_INODE){
+			ptr = &inode.direct[live[i].lblock];
+		}else if(has_indirect && live[i].lblock - POINTERS_PER_INODE < POINTERS_PER_BLOCK){
+			ptr = &indirect_block->pointers[live[i].lblock - POINTERS_PER_INODE];
+			indirect_changed = true;
+		}
+		if(!ptr || *ptr != live[i].blocknum) continue;
+
+		cache_read(fs->cache, live[i].blocknum, block->data, CACHE_DATA);
+		*ptr = log_append_meta(fs, block->data, inumber, live[i].lblock);
+		alloc_free(&fs->block_alloc, live[i].blocknum);
+		changed = true;
+	}
+
+	if(indirect_changed){
+		int location = log_append_meta(fs, indirect_block->data, inumber, SUMMARY_INDIRECT);
+		alloc_free(&fs->block_alloc, inode.indirect);
+		inode.indirect = location;
+		changed = true;
+	}
+	if(changed) inode_save(fs, inumber, &inode);
+}
+
+// Copy the live blocks of a segment to the head of the log, leaving the
+// whole segment free
+void log_clean( fs_t *fs, int segment ){
+	SPAN("log_clean", segment);
+	union fs_block *summary POOL_SCOPED = pool_get();
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
+	struct log_live live[SEGMENT_BLOCKS];
+	int first = segment_first(fs, segment), nlive = 0, i;
+
+	cache_read(fs->cache, first, summary->data, CACHE_META);
+	for(i = 1; i < SEGMENT_BLOCKS; i++){
+		if(bitmap_test(fs->free_block_bm, first + i)) continue;
+		live[nlive].blocknum = first + i;
+		live[nlive].inumber = summary->summary.entry[i].inumber;
+		live[nlive].lblock = summary->summary.entry[i].lblock;
+		nlive++;
+	}
+	qsort(live, nlive, sizeof(struct log_live), log_live_compare);
+
+	for(i = 0; i < nlive; ){
+		// Inode table blocks move as they are, the inode map follows them
+		if(live[i].lblock == SUMMARY_INODES){
+			if(fs->imap[live[i].inumber] == live[i].blocknum){
+				cache_read(fs->cache, live[i].blocknum, block->data, CACHE_META);
+				log_inode_block_append(fs, live[i].inumber, block->data);
+			}
+			i++;
+			continue;
+		}
+
+		int end = i;
+		while(end < nlive && live[end].inumber == live[i].inumber) end++;
+		log_clean_inode(fs, live[i].inumber, live + i, end - i, block, indirect_block);
+		i = end;
+	}
+}
+
+// Make sure need more blocks can be appended. LOG_RESERVE more are held
+// back for the cleaner itself. Segments are cleaned ahead by the cleaner
+// thread; a caller only cleans for itself when the cleaner has fallen
+// behind and the log is out of room.
+#define LOG_RESERVE     (2 * SEGMENT_BLOCKS)
+#define LOG_CLEAN_AHEAD (LOG_RESERVE + 4 * SEGMENT_BLOCKS)
+
+void log_make_room( fs_t *fs, int need ){
+	SPAN("log_make_room", need);
+	if(fs->log_room < LOG_CLEAN_AHEAD && !fs->clean_wanted && fs->clean_seq != fs->mounted_super.log_seq){
+		fs->clean_wanted = true;
+		fs->clean_seq = fs->mounted_super.log_seq;
+		pthread_cond_signal(&fs->clean_wake);
+	}
+	if(fs->log_room >= need + LOG_RESERVE) return;
+
+	fs->log_room = log_free_slots(fs);
+	while(fs->log_room < need + LOG_RESERVE){
+		int victim = log_pick_victim(fs);
+		if(victim < 0) break;
+		int before = fs->log_room;
+		log_clean(fs, victim);
+		fs->log_room = log_free_slots(fs);
+		if(fs->log_room <= before) break; // Cleaning no longer gains anything
+	}
+}
+
+// One victim of the cleaner, if the log is short of LOG_CLEAN_AHEAD free
+// slots. Returns whether cleaning it gained anything.
+bool log_clean_step( fs_t *fs ){
+	fs->log_room = log_free_slots(fs);
+	if(fs->log_room >= LOG_CLEAN_AHEAD) return false;
+	int victim = log_pick_victim(fs);
+	if(victim < 0) return false;
+	int before = fs->log_room;
+	log_clean(fs, victim);
+	fs->log_room = log_free_slots(fs);
+	return fs->log_room > before;
+}
+
+// Deferred freeing
+
+// Free the nonzero pointers in a run, up to limit of them, and queue them
+// for discard. Returns how many were freed.
+int reclaim_run( fs_t *fs, const int *pointers, int n, int limit ){
+	int count = scan_pointers(pointers, n, limit, fs->mounted_super.nblocks, fs->free_block_bm, true);
+
+	// The last checkpoint of a log may still point at the blocks, so they
+	// are left for segment reuse instead of discarded
+	if(!log_mode(fs)){
+		int i, left = count;
+		for(i = 0; i < n && left > 0; i++){
+			if(!pointers[i]) continue;
+			discard_add(fs, pointers[i]);
+			left--;
+		}
+	}
+	return count;
+}
+
+// Free the next batch of blocks of the newest orphan. Once they are all
+// free the orphan's inode is cleared.
+#define RECLAIM_BATCH 256
+
+void reclaim_step( fs_t *fs ){
+	SPAN("reclaim_step", -1);
+	struct orphan *o = &fs->orphans[fs->norphans - 1];
+
+	if(o->next < POINTERS_PER_INODE){
+		o->remaining -= reclaim_run(fs, o->inode.direct, POINTERS_PER_INODE, o->remaining);
+		o->next = POINTERS_PER_INODE;
+	}
+	if(o->inode.indirect && o->next < POINTERS_PER_INODE + POINTERS_PER_BLOCK){
+		if(o->remaining > 0){
+			union fs_block *indirect_block POOL_SCOPED = pool_get();
+			block_read(fs, o->inode.indirect, indirect_block->data, CACHE_META);
+			int first = o->next - POINTERS_PER_INODE;
+			int n = POINTERS_PER_BLOCK - first < RECLAIM_BATCH ? POINTERS_PER_BLOCK - first : RECLAIM_BATCH;
+			o->remaining -= reclaim_run(fs, indirect_block->pointers + first, n, o->remaining);
+			o->next += n;
+			if(o->remaining > 0 && o->next < POINTERS_PER_INODE + POINTERS_PER_BLOCK) return;
+		}
+
+		// The indirect block goes last, once nothing more is read from it
+		if(ceil((double)o->inode.size / DISK_BLOCK_SIZE) > POINTERS_PER_INODE){
+			reclaim_run(fs, &o->inode.indirect, 1, 1);
+		}
+		o->next = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+	}
+
+	// The inumber may have been handed out again in the meantime
+	int inumber = o->inumber;
+	fs->norphans--;
+	if(!itable_orphan(&fs->inode_table, inumber)) return;
+	if(log_mode(fs)) log_make_room(fs, 1);
+	struct fs_inode inode;
+	memset(&inode, 0, sizeof(inode));
+	inode_save(fs, inumber, &inode);
+}
+
+void orphans_drain( fs_t *fs ){
+	while(fs->norphans > 0) reclaim_step(fs);
+}
+
+// A background thread leaves by taking itself off the count fs_close waits on
+void thread_exit( fs_t *fs ){
+	fs->threads--;
+	pthread_cond_broadcast(&fs->threads_done);
+	pthread_mutex_unlock(&fs->lock);
+}
+
+// Frees the blocks of orphans, once a lazy mount's scan has finished the
+// free block bitmap; mount_scan_finish wakes it for the orphans it found
+void *reclaimer( void *arg ){
+	fs_t *fs = arg;
+	pthread_mutex_lock(&fs->lock);
+	while(true){
+		while(!fs->closing && (!fs->is_mounted || fs->norphans == 0 || fs->scan_next < fs->scan_end)){
+			pthread_cond_wait(&fs->reclaim_wake, &fs->lock);
+		}
+		if(fs->closing) break;
+		reclaim_step(fs);
+
+		// Let API calls in between batches
+		pthread_mutex_unlock(&fs->lock);
+		sched_yield();
+		pthread_mutex_lock(&fs->lock);
+	}
+	thread_exit(fs);
+	return 0;
+}
+
+// Cleans segments of a log-structured file system one at a time until
+// LOG_CLEAN_AHEAD slots are free or no victim is worth it. Not while a
+// lazy mount is still scanning: cleaning looks up inodes.
+void *cleaner( void *arg ){
+	fs_t *fs = arg;
+	pthread_mutex_lock(&fs->lock);
+	while(true){
+		while(!fs->closing && !fs->clean_wanted) pthread_cond_wait(&fs->clean_wake, &fs->lock);
+		if(fs->closing) break;
+		bool ready = fs->is_mounted && log_mode(fs) && fs->scan_next >= fs->scan_end;
+		if(!ready || !log_clean_step(fs)) fs->clean_wanted = false;
+
+		// Let API calls in between segments
+		pthread_mutex_unlock(&fs->lock);
+		sched_yield();
+		pthread_mutex_lock(&fs->lock);
+	}
+	thread_exit(fs);
+	return 0;
+}
+
+// Start a background thread for the instance; fs_close waits for it
+bool thread_start( fs_t *fs, void *(*fn)( void * ) ){
+	pthread_t thread;
+	fs->threads++;
+	if(pthread_create(&thread, 0, fn, fs) != 0){
+		fs->threads--;
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+// Access hints
+
+// The hints that cover a byte of a file, if any
+struct advice *advice_find( fs_t *fs, int inumber, int offset ){
+	int i;
+	for(i = 0; i < ADVICE_SLOTS; i++){
+		struct advice *a = &fs->advice[i];
+		if(a->inumber != inumber) continue;
+		if(offset < a->start || (a->end && offset >= a->end)) return 0;
+		a->used = ++fs->advice_clock;
+		return a;
+	}
+	return 0;
+}
+
+// A file's slot, taking the least recently used one if it has none
+struct advice *advice_slot( fs_t *fs, int inumber ){
+	struct advice *oldest = &fs->advice[0];
+	int i;
+	for(i = 0; i < ADVICE_SLOTS; i++){
+		struct advice *a = &fs->advice[i];
+		if(a->inumber == inumber) return a;
+		if(a->used < oldest->used) oldest = a;
+	}
+	memset(oldest, 0, sizeof(*oldest));
+	oldest->inumber = inumber;
+	return oldest;
+}
+
+void advice_forget( fs_t *fs, int inumber ){
+	int i;
+	for(i = 0; i < ADVICE_SLOTS; i++){
+		if(fs->advice[i].inumber == inumber) memset(&fs->advice[i], 0, sizeof(struct advice));
+	}
+}
+
+// Hand a deleted inode to the reclaimer. The inode must already be saved
+// as an orphan; inode holds its block map.
+void orphan_add( fs_t *fs, int inumber, const struct fs_inode *inode ){
+	if(fs->norphans == fs->orphans_max){
+		struct orphan *grown = realloc(fs->orphans, 2 * fs->orphans_max * sizeof(struct orphan));
+		if(grown){
+			fs->orphans = grown;
+			fs->orphans_max *= 2;
+		}else{
+			orphans_drain(fs); // No memory to queue more, so catch up now
+		}
+	}
+
+	advice_forget(fs, inumber);
+	struct orphan *o = &fs->orphans[fs->norphans++];
+	o->inumber = inumber;
+	o->next = 0;
+	o->remaining = ceil((double)inode->size / DISK_BLOCK_SIZE);
+	o->inode = *inode;
+	pthread_cond_signal(&fs->reclaim_wake);
+}
+
+// Group commit
+
+#define GROUP_COMMIT_WINDOW 200 // us a sync waits for company when the last one had some
+
+// Make everything written so far to disk durable, sharing one sync with
+// every caller that gets here before it starts. Whoever finds no sync
+// running leads: it lets go of the lock, gives others a moment to join if
+// the last group had more than one caller, then syncs for all of them.
+// Everyone else waits for a sync that covers their ticket. Called with the
+// lock held once.
+bool group_commit( fs_t *fs, struct sync_group *g, disk_t *disk ){
+	SPAN("group_commit", -1);
+	long long ticket = ++g->ticket;
+	while(g->done < ticket){
+		if(g->running){
+			pthread_cond_wait(&g->cond, &fs->lock);
+			continue;
+		}
+
+		g->running = true;
+		if(g->last_group > 1){
+			pthread_mutex_unlock(&fs->lock);
+			usleep(GROUP_COMMIT_WINDOW);
+			pthread_mutex_lock(&fs->lock);
+		}
+		long long first = g->done + 1, last = g->ticket;
+		pthread_mutex_unlock(&fs->lock);
+		bool ok = disk_sync(disk);
+		pthread_mutex_lock(&fs->lock);
+
+		if(!ok){
+			g->fail_lo = first;
+			g->fail_hi = last;
+		}
+		g->done = last;
+		g->last_group = last - first + 1;
+		g->flushes++;
+		g->running = false;
+		pthread_cond_broadcast(&g->cond);
+	}
+	return ticket < g->fail_lo || ticket > g->fail_hi;
+}
+
+bool image_commit( fs_t *fs ){
+	fs->sync_calls++;
+	return group_commit(fs, &fs->sync_main, fs->disk);
+}
+
+// Intent log
+
+// Bring the image up to date with everything in the intent log, make it
+// durable and start the log over. Anything may be written to the image
+// again before this; nothing in the log is lost until the image is synced.
+bool intent_checkpoint( fs_t *fs ){
+	SPAN("intent_checkpoint", -1);
+	if(!fs->intent || intent_used(fs->intent) == 0) return true;
+	cache_flush(fs->cache, 0, INT_MAX);
+	if(log_mode(fs)) log_checkpoint(fs);
+	if(!disk_sync(fs->disk)) return false;
+	fs->intent_checkpoints++;
+	return intent_reset(fs->intent);
+}
+
+// The log is checkpointed in the background once it is this full, so
+// synchronous writers rarely find it out of room
+bool intent_half_full( fs_t *fs ){
+	return fs->intent && intent_used(fs->intent) > intent_size(fs->intent) / 2;
+}
+
+// Write-back
+
+#define FLUSH_INTERVAL 500  // ms between flusher passes
+#define FLUSH_BATCH    256  // blocks written per hold of the lock
+#define THROTTLE_PAUSE 20   // ms a writer waits just under the dirty limit
+
+// Dirty blocks allowed before writers are made to flush; the flusher
+// starts on the oldest once half as many are dirty
+int dirty_limit( fs_t *fs ){
+	struct cache_stats stats;
+	cache_stats(fs->cache, &stats);
+	return (long long)stats.part[CACHE_DATA].capacity * fs->dirty_ratio / 100;
+}
+
+int dirty_blocks( fs_t *fs ){
+	struct cache_stats stats;
+	cache_stats(fs->cache, &stats);
+	return stats.dirty;
+}
+
+// One batch of the oldest dirty blocks, as the flusher picks them
+int flush_batch( fs_t *fs ){
+	SPAN("flush_batch", -1);
+	int n = cache_flush(fs->cache, fs->dirty_expire, FLUSH_BATCH);
+	if(n == 0 && dirty_blocks(fs) > dirty_limit(fs) / 2) n = cache_flush(fs->cache, 0, FLUSH_BATCH);
+	PROBE1(flush_batch, n);
+	return n;
+}
+
+// Every FLUSH_INTERVAL, or sooner when writers call, write out the blocks
+// that have been dirty longer than dirty_expire, and the oldest of the
+// rest while more than half the limit is dirty
+void *flusher( void *arg ){
+	fs_t *fs = arg;
+	pthread_mutex_lock(&fs->lock);
+	while(!fs->closing){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += FLUSH_INTERVAL * 1000000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&fs->flush_wake, &fs->lock, &until);
+		if(!fs->closing && fs->is_mounted && intent_half_full(fs)) intent_checkpoint(fs);
+
+		while(!fs->closing && fs->is_mounted){
+			if(flush_batch(fs) == 0) break;
+
+			// Let API calls in between batches
+			pthread_mutex_unlock(&fs->lock);
+			sched_yield();
+			pthread_mutex_lock(&fs->lock);
+		}
+	}
+	thread_exit(fs);
+	return 0;
+}
+
+// Called by writers before they take the lock. Below half the limit they
+// go straight on. Above it the flusher is woken and the writer sleeps for
+// a pause that grows with the square of how close the limit is, so writers
+// slow down gradually instead of stopping. At the limit a writer flushes a
+// batch itself, so it still makes progress.
+void dirty_throttle( fs_t *fs ){
+	SPAN("dirty_throttle", -1);
+	pthread_mutex_lock(&fs->lock);
+	int limit = dirty_limit(fs), dirty = dirty_blocks(fs), background = limit / 2;
+	if(dirty > background) pthread_cond_signal(&fs->flush_wake);
+	if(dirty >= limit && dirty > 0){
+		cache_flush(fs->cache, 0, FLUSH_BATCH);
+		pthread_mutex_unlock(&fs->lock);
+		return;
+	}
+	pthread_mutex_unlock(&fs->lock);
+
+	if(dirty > background){
+		double x = (double)(dirty - background) / (limit - background);
+		usleep(THROTTLE_PAUSE * 1000 * x * x);
+	}
+}
+
+// Copy-on-write: every block written goes to the head of the log along with
+// the indirect block and inode that point at it, and the old copies are freed
+int log_write( fs_t *fs, int inumber, const char *data, int length, int offset ){
+	SPAN("log_write", inumber);
+	int max = (POINTERS_PER_INODE + POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE;
+	if(offset >= max) return 0;
+	if(length > max - offset) length = max - offset;
+
+	// Clean before loading the inode, since cleaning may move its blocks.
+	// Blocks still held by orphans count too when the log runs short.
+	int nblocks = (offset + length - 1) / DISK_BLOCK_SIZE - offset / DISK_BLOCK_SIZE + 1;
+	if(fs->norphans > 0 && fs->log_room < nblocks + 2 + LOG_RESERVE) orphans_drain(fs);
+	log_make_room(fs, nblocks + 2);
+
+	struct fs_inode inode;
+	inode_load(fs, inumber, &inode);
+	int size = inode.size;
+	if(offset > size) return 0; // Files have no holes
+
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
+	bool has_indirect = inode.indirect && ceil((double)size / DISK_BLOCK_SIZE) > POINTERS_PER_INODE;
+	if(has_indirect){
+		block_read(fs, inode.indirect, indirect_block->data, CACHE_META);
+	}else{
+		memset(indirect_block->data, 0, DISK_BLOCK_SIZE);
+	}
+
+	bool indirect_changed = false;
+	int write_counter = 0;
+	while(length > 0){
+		int offset_ptr = offset / DISK_BLOCK_SIZE;
+		int block_offset = offset % DISK_BLOCK_SIZE;
+		int chunk = DISK_BLOCK_SIZE - block_offset;
+		if(chunk > length) chunk = length;
+
+		int *ptr;
+		if(offset_ptr < POINTERS_PER_INODE){
+			ptr = &inode.direct[offset_ptr];
+		}else{
+			ptr = &indirect_block->pointers[offset_ptr - POINTERS_PER_INODE];
+		}
+		int old = offset_ptr * DISK_BLOCK_SIZE < size ? *ptr : 0;
+
+		// A partial block keeps the rest of its old contents
+		if(chunk < DISK_BLOCK_SIZE && old){
+			block_read(fs, old, block->data, CACHE_DATA);
+		}else if(chunk < DISK_BLOCK_SIZE){
+			memset(block->data, 0, DISK_BLOCK_SIZE);
+		}
+		memcpy(block->data + block_offset, data + write_counter, chunk);
+
+		// Stop short rather than eat the space the metadata still needs
+		if(fs->log_room <= SEGMENT_BLOCKS) break;
+		int location = log_append(fs, block->data, inumber, offset_ptr);
+		if(!location) break;
+		if(old) alloc_free(&fs->block_alloc, old);
+		*ptr = location;
+		if(offset_ptr >= POINTERS_PER_INODE) indirect_changed = true;
+
+		write_counter += chunk;
+		offset += chunk;
+		length -= chunk;
+		if(offset > inode.size) inode.size = offset;
+	}
+
+	if(indirect_changed){
+		int location = log_append_meta(fs, indirect_block->data, inumber, SUMMARY_INDIRECT);
+		if(has_indirect) alloc_free(&fs->block_alloc, inode.indirect);
+		inode.indirect = location;
+	}
+	if(write_counter > 0) inode_save(fs, inumber, &inode);
+	return write_counter;
+}
+
+// High Level Functions
+
+// A new instance has a pass-through cache in front of the disk, write-back
+// once the cache is given room, and no threads; the reclaimer and the
+// flusher start at its first mount, the cleaner at its first log mount
+fs_t *fs_open( disk_t *disk ){
+	PROBE0(fs_open_entry);
+	fs_t *fs;
+	if(posix_memalign((void **)&fs, 64, sizeof(fs_t))) FS_RETURN(fs_open, (fs_t *)0); // block_alloc is cache line aligned
+	memset(fs, 0, sizeof(fs_t));
+	fs->disk = disk;
+	fs->cache = cache_open(disk);
+	if(!fs->cache){
+		free(fs);
+		FS_RETURN(fs_open, (fs_t *)0);
+	}
+	fs->dirty_expire = 3000;
+	fs->dirty_ratio = 20;
+	cache_set_writeback(fs->cache, true);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&fs->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&fs->reclaim_wake, 0);
+	pthread_cond_init(&fs->flush_wake, 0);
+	pthread_cond_init(&fs->clean_wake, 0);
+	pthread_cond_init(&fs->sync_main.cond, 0);
+	pthread_cond_init(&fs->sync_intent.cond, 0);
+	pthread_cond_init(&fs->scan_done, 0);
+	pthread_cond_init(&fs->threads_done, 0);
+	FS_RETURN(fs_open, fs);
+}
+
+// Unmount, wait for the background threads to leave, then free it all.
+// The disk stays open.
+void fs_close( fs_t *fs ){
+	if(!fs) return;
+	PROBE0(fs_close_entry);
+	pthread_mutex_lock(&fs->lock);
+	fs_unmount(fs);
+	fs->closing = true;
+	pthread_cond_broadcast(&fs->reclaim_wake);
+	pthread_cond_broadcast(&fs->flush_wake);
+	pthread_cond_broadcast(&fs->clean_wake);
+	while(fs->threads > 0) pthread_cond_wait(&fs->threads_done, &fs->lock);
+	pthread_mutex_unlock(&fs->lock);
+
+	cache_close(fs->cache);
+	if(fs->intent) intent_close(fs->intent);
+	free(fs->orphans);
+	pthread_cond_destroy(&fs->reclaim_wake);
+	pthread_cond_destroy(&fs->flush_wake);
+	pthread_cond_destroy(&fs->clean_wake);
+	pthread_cond_destroy(&fs->sync_main.cond);
+	pthread_cond_destroy(&fs->sync_intent.cond);
+	pthread_cond_destroy(&fs->scan_done);
+	pthread_cond_destroy(&fs->threads_done);
+	pthread_mutex_destroy(&fs->lock);
+	free(fs);
+	PROBE0(fs_close_return);
+}
+
+int fs_cache_size( fs_t *fs, int capacity, int meta_capacity ){
+	PROBE2(fs_cache_size_entry, capacity, meta_capacity);
+	FS_LOCKED;
+	FS_RETURN(fs_cache_size, cache_init(fs->cache, capacity, meta_capacity));
+}
+
+void fs_cache_stats( fs_t *fs, struct cache_stats *stats ){
+	PROBE0(fs_cache_stats_entry);
+	FS_LOCKED;
+	cache_stats(fs->cache, stats);
+	PROBE0(fs_cache_stats_return);
+}
+
+int fs_cache_trace( fs_t *fs, const char *filename ){
+	PROBE0(fs_cache_trace_entry);
+	FS_LOCKED;
+	FS_RETURN(fs_cache_trace, cache_trace(fs->cache, filename));
+}
 
-int fs_format(){
+int format_disk( fs_t *fs, int features ){
+	SPAN("fs_format", -1);
+	FS_LOCKED;
 	// Check if the disk is mounted; if it is, do nothing and return failure
-	if(is_mounted) return 0;
+	if(fs->is_mounted) return 0;
 
-	// Set all inodes to be invalid if the disk
-	union fs_block super_block;
-	disk_read(0, super_block.data);
-	if(super_block.super.magic == FS_MAGIC){
-		int inode;
-		for(inode = 0; inode < super_block.super.ninodeblocks; inode++){
-			char new_block[DISK_BLOCK_SIZE] = {0};
-			disk_write(inode + 1, new_block);
+	// Create then write the new valid superblock. The inode table is not
+	// written: with a zero watermark every inode reads as invalid, and
+	// blocks are zeroed as they come into use.
+	union fs_block *block POOL_SCOPED = pool_get();
+	memset(block->data, 0, DISK_BLOCK_SIZE);
+	block->super.magic = FS_MAGIC;
+	block->super.nblocks = disk_size(fs->disk);
+	block->super.ninodeblocks = ceil(disk_size(fs->disk) / 10.0);
+	block->super.ninodes = block->super.ninodeblocks * INODES_PER_BLOCK;
+	block->super.features = features;
+	block->super.inode_watermark = 0;
+
+	// Whatever the intent log holds was written to the old file system
+	if(fs->intent && intent_used(fs->intent) > 0 && !intent_reset(fs->intent)) return 0;
+
+	if(features & FS_FEATURE_LOG){
+		// The inode table lives in the log; only the inode map is fixed,
+		// and it needs room for at least a few segments after it
+		block->super.imap_blocks = ceil((double)block->super.ninodeblocks / POINTERS_PER_BLOCK);
+		if(log_nsegments(&block->super) < 4) return 0;
+		int imap_blocks = block->super.imap_blocks, i;
+		cache_write(fs->cache, 0, block->data, CACHE_META);
+
+		memset(block->data, 0, DISK_BLOCK_SIZE);
+		for(i = 0; i < imap_blocks; i++){
+			cache_write(fs->cache, 1 + i, block->data, CACHE_META);
 		}
+		return 1;
 	}
+	cache_write(fs->cache, 0, block->data, CACHE_META);
 
-	// Create then write the new valid superblock
- 	union fs_block new_super;
-	new_super.super.magic = FS_MAGIC;
-	new_super.super.nblocks = disk_size();
-	new_super.super.ninodeblocks = ceil(disk_size() / 10.0);
-	new_super.super.ninodes = new_super.super.ninodeblocks * INODES_PER_BLOCK;
-	disk_write(0, new_super.data);
+	// Hand the old inode table back to the host where it supports holes
+	cache_discard(fs->cache, 1, block->super.ninodeblocks);
 
 	return 1;
 }
 
-void fs_debug(){
-	union fs_block super_block, block;
+int fs_format( fs_t *fs ){
+	PROBE0(fs_format_entry);
+	FS_RETURN(fs_format, format_disk(fs, FS_FEATURE_LAZY_ITABLE));
+}
+
+int fs_format_log( fs_t *fs ){
+	PROBE0(fs_format_log_entry);
+	FS_RETURN(fs_format_log, format_disk(fs, FS_FEATURE_LOG));
+}
+
+void fs_debug( fs_t *fs ){
+	PROBE0(fs_debug_entry);
+	FS_LOCKED;
+	union fs_block *super_block POOL_SCOPED = pool_get();
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
+	union fs_block *imap_block POOL_SCOPED = pool_get();
+
+	// A mounted log may be ahead of the disk
+	if(fs->is_mounted && log_mode(fs)) log_checkpoint(fs);
 
 	// Super Block
-	disk_read(0, super_block.data);
+	cache_read(fs->cache, 0, super_block->data, CACHE_META);
 	printf("superblock:\n");
-	if(super_block.super.magic == FS_MAGIC){
+	if(super_block->super.magic == FS_MAGIC){
 		printf("\tmagic number is valid\n");
 	}else{
 		printf("\tmagic number is NOT valid\n");
+		PROBE0(fs_debug_return);
 		return;
 	}
-	printf("\t%d blocks\n", super_block.super.nblocks);
-	printf("\t%d inode blocks\n", super_block.super.ninodeblocks);
-	printf("\t%d inodes\n", super_block.super.ninodes);
+	printf("\t%d blocks\n", super_block->super.nblocks);
+	printf("\t%d inode blocks\n", super_block->super.ninodeblocks);
+	printf("\t%d inodes\n", super_block->super.ninodes);
+	bool log = super_block->super.features & FS_FEATURE_LOG;
+	if(log){
+		printf("\tlog-structured, %d segments of %d blocks\n", log_nsegments(&super_block->super), SEGMENT_BLOCKS);
+	}
 
 	// Scan for used inodes and report
-	int inode_block;
-	for(inode_block = 0; inode_block < super_block.super.ninodeblocks; inode_block++){
-		disk_read(inode_block + 1, block.data);
+	int inode_block, location;
+	int ninodeblocks = log ? super_block->super.ninodeblocks : inode_blocks_initialized(&super_block->super);
+	for(inode_block = 0; inode_block < ninodeblocks; inode_block++){
+		// Log mode finds inode blocks through the inode map
+		location = inode_block + 1;
+		if(log){
+			if(inode_block % POINTERS_PER_BLOCK == 0){
+				cache_read(fs->cache, 1 + inode_block / POINTERS_PER_BLOCK, imap_block->data, CACHE_META);
+			}
+			location = imap_block->pointers[inode_block % POINTERS_PER_BLOCK];
+			if(!location) continue;
+		}
+		cache_read(fs->cache, location, block->data, CACHE_META);
 
 		// Check each inode in the block and check if it is valid
 		int inode;
 		for(inode = 0; inode < INODES_PER_BLOCK; inode++){
-			if(block.inode[inode].isvalid){
+			if(block->inode[inode].isvalid && block->inode[inode].isvalid != FS_INODE_ORPHAN){
 				printf("inode %d:\n", inode + (INODES_PER_BLOCK * inode_block));
 
 				// Print out the size of the inode data
-				int size = block.inode[inode].size;
+				int size = block->inode[inode].size;
 				printf("\tsize: %d bytes\n", size);
 
 				// Print out which blocks are pointed to:
@@ -167,26 +1292,25 @@ void fs_debug(){
 					int direct;
 					for(direct = 0; direct < POINTERS_PER_INODE; direct++){
 						if(size <= 0) break;
-						if(block.inode[inode].direct[direct]){
-							printf(" %d", block.inode[inode].direct[direct]);
+						if(block->inode[inode].direct[direct]){
+							printf(" %d", block->inode[inode].direct[direct]);
 							size -= DISK_BLOCK_SIZE;
 						}
 					}
 					printf("\n");
 				}
 				// Indirect block
-				if(size > 0 && block.inode[inode].indirect){
-					printf("\tindirect block: %d\n", block.inode[inode].indirect);
+				if(size > 0 && block->inode[inode].indirect){
+					printf("\tindirect block: %d\n", block->inode[inode].indirect);
 
 					// Blocks pointed to by pointers in the indirect block
 					printf("\tindirect data blocks:");
-					union fs_block indirect_block;
-					disk_read(block.inode[inode].indirect, indirect_block.data);
+					cache_read(fs->cache, block->inode[inode].indirect, indirect_block->data, CACHE_META);
 					int indirect;
 					for(indirect = 0; indirect < POINTERS_PER_BLOCK; indirect++){
 						if(size <= 0) break;
-						if(indirect_block.pointers[indirect]){
-							printf(" %d", indirect_block.pointers[indirect]);
+						if(indirect_block->pointers[indirect]){
+							printf(" %d", indirect_block->pointers[indirect]);
 							size -= DISK_BLOCK_SIZE;
 						}
 					}
@@ -195,229 +1319,970 @@ void fs_debug(){
 			}
 		}
 	}
+	PROBE0(fs_debug_return);
+}
+
+// Load the inode map and set up segment state for a log-structured disk
+bool log_mount( fs_t *fs ){
+	int nsegments = log_nsegments(&fs->mounted_super), i;
+	fs->imap = calloc(fs->mounted_super.imap_blocks * POINTERS_PER_BLOCK, sizeof(int));
+	fs->imap_dirty = calloc(BITMAP_WORDS(fs->mounted_super.imap_blocks), sizeof(uint64_t));
+	fs->segment_seq = calloc(nsegments, sizeof(int));
+	if(posix_memalign((void **)&fs->log_buffer, DISK_BLOCK_SIZE, SEGMENT_BLOCKS * DISK_BLOCK_SIZE)) fs->log_buffer = 0;
+	if(!fs->imap || !fs->imap_dirty || !fs->segment_seq || !fs->log_buffer) return false;
+
+	for(i = 0; i < fs->mounted_super.imap_blocks; i++){
+		bitmap_clear(fs->free_block_bm, 1 + i);
+		cache_read(fs->cache, 1 + i, (char *)(fs->imap + i * POINTERS_PER_BLOCK), CACHE_META);
+	}
+	for(i = 0; i < fs->mounted_super.ninodeblocks; i++){
+		if(fs->imap[i] < 0 || fs->imap[i] >= fs->mounted_super.nblocks) fs->imap[i] = 0;
+	}
+
+	// Summaries are rewritten with their segment, never allocated on their own
+	for(i = 0; i < nsegments; i++){
+		bitmap_clear(fs->free_block_bm, segment_first(fs, i));
+	}
+	fs->log_start = 0;
+	fs->log_used = 0;
+	fs->log_room = 0;
+	return true;
+}
+
+// Once the bitmap is built, read the age of every segment still in use
+void log_mount_ages( fs_t *fs, union fs_block *block ){
+	int nsegments = log_nsegments(&fs->mounted_super), segment;
+	for(segment = 0; segment < nsegments; segment++){
+		if(segment_live(fs, segment) == 0) continue;
+		cache_read(fs->cache, segment_first(fs, segment), block->data, CACHE_META);
+		fs->segment_seq[segment] = block->summary.seq;
+	}
+}
+
+void log_release( fs_t *fs ){
+	free(fs->imap);
+	free(fs->imap_dirty);
+	free(fs->segment_seq);
+	free(fs->log_buffer);
+	fs->imap = 0;
+	fs->imap_dirty = 0;
+	fs->segment_seq = 0;
+	fs->log_buffer = 0;
+	fs->log_start = 0;
+	fs->clean_wanted = false;
+}
+
+// Add one block of the inode table to the inode table in memory and mark
+// the blocks its inodes own as in use
+void mount_scan_block( fs_t *fs, int inode_block, union fs_block *block, union fs_block *indirect_block ){
+	SPAN("mount_scan_block", inode_block);
+	// Log mode finds inode blocks through the inode map
+	int location = log_mode(fs) ? fs->imap[inode_block] : inode_block + 1;
+	if(!location) return;
+	bitmap_clear(fs->free_block_bm, location);
+	cache_read(fs->cache, location, block->data, CACHE_META);
+
+	// Check each inode in the block and check if it is valid
+	int inode;
+	for(inode = 0; inode < INODES_PER_BLOCK; inode++){
+		if(block->inode[inode].isvalid){
+			itable_set(&fs->inode_table, inode + (INODES_PER_BLOCK * inode_block), &block->inode[inode]);
+			inode_mark_blocks(fs, &block->inode[inode], indirect_block, false);
+		}
+		// A delete that was not finished before the last unmount
+		if(block->inode[inode].isvalid == FS_INODE_ORPHAN){
+			orphan_add(fs, inode + (INODES_PER_BLOCK * inode_block), &block->inode[inode]);
+		}
+	}
+}
+
+// The free block bitmap is now complete
+void mount_scan_finish( fs_t *fs, union fs_block *block ){
+	if(log_mode(fs)) log_mount_ages(fs, block);
+	if(fs->norphans > 0) pthread_cond_signal(&fs->reclaim_wake);
+	pthread_cond_broadcast(&fs->scan_done);
+}
+
+// Background half of a lazy mount: scan the inode table a chunk at a time,
+// letting API calls in between chunks. A new mount or an unmount changes
+// the generation, which ends the scan.
+#define SCAN_CHUNK 64
+
+void *mount_scanner( void *arg ){
+	fs_t *fs = arg;
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
+
+	pthread_mutex_lock(&fs->lock);
+	int generation = fs->scan_generation;
+	while(generation == fs->scan_generation && fs->scan_next < fs->scan_end){
+		int end = fs->scan_next + SCAN_CHUNK < fs->scan_end ? fs->scan_next + SCAN_CHUNK : fs->scan_end;
+		for(; fs->scan_next < end; fs->scan_next++){
+			mount_scan_block(fs, fs->scan_next, block, indirect_block);
+		}
+		if(fs->scan_next == fs->scan_end){
+			mount_scan_finish(fs, block);
+		}else{
+			pthread_mutex_unlock(&fs->lock);
+			sched_yield();
+			pthread_mutex_lock(&fs->lock);
+		}
+	}
+	thread_exit(fs);
+	return 0;
+}
+
+// Calls that allocate blocks or need the whole inode table wait for the
+// scan of a lazy mount to finish
+void scan_wait( fs_t *fs ){
+	while(fs->is_mounted && fs->scan_next < fs->scan_end) pthread_cond_wait(&fs->scan_done, &fs->lock);
+}
+
+int file_write( fs_t *fs, int inumber, const char *data, int length, int offset );
+
+int intent_replay_one( void *arg, int inumber, const char *data, int length, int offset ){
+	fs_t *fs = arg;
+	if(!is_valid_inumber(fs, inumber)){
+		fs->intent_skipped++;
+		return 0;
+	}
+	return file_write(fs, inumber, data, length, offset);
 }
 
-int fs_mount(){
+int mount_disk( fs_t *fs, bool lazy ){
+	SPAN("fs_mount", -1);
+	FS_LOCKED;
+	// Mounting again first drops the previous mount
+	if(fs->is_mounted) fs_unmount(fs);
+
 	// Check the disk for a file system
-	union fs_block super_block, block;
-	disk_read(0, super_block.data);
-	if(super_block.super.magic != FS_MAGIC){
+	union fs_block *super_block POOL_SCOPED = pool_get();
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
+	cache_read(fs->cache, 0, super_block->data, CACHE_META);
+	if(super_block->super.magic != FS_MAGIC){
 		return 0; // Disk does not have this file system
 	}
+	if(super_block->super.nblocks > disk_size(fs->disk)){
+		return 0; // File system is bigger than the disk, e.g. after a resize
+	}
 
 	// Create a free block bitmap
-	free_block_bm = malloc(super_block.super.nblocks * sizeof(bool));
-	memset(free_block_bm, true, super_block.super.nblocks * sizeof(bool));
-	free_block_bm[0] = false; // Super block always in use
+	fs->mounted_super = super_block->super;
+	free(fs->free_block_bm);
+	fs->free_block_bm = malloc(BITMAP_WORDS(fs->mounted_super.nblocks) * sizeof(uint64_t));
+	memset(fs->free_block_bm, 0xff, BITMAP_WORDS(fs->mounted_super.nblocks) * sizeof(uint64_t));
+	bitmap_clear(fs->free_block_bm, 0); // Super block always in use
+	alloc_init(&fs->block_alloc, fs->free_block_bm, fs->mounted_super.nblocks, fs->mounted_super.ninodeblocks + 1, 1);
+
+	// Create the in-memory inode table alongside it
+	itable_free(&fs->inode_table);
+	if(!itable_init(&fs->inode_table, super_block->super.ninodes)){
+		return 0;
+	}
+
+	// And an empty queue for the orphans the scan finds
+	fs->norphans = 0;
+	if(!fs->orphans){
+		fs->orphans = malloc(64 * sizeof(struct orphan));
+		if(!fs->orphans) return 0;
+		fs->orphans_max = 64;
+	}
+	if(!fs->reclaimer_started) fs->reclaimer_started = thread_start(fs, reclaimer);
+	if(!fs->flusher_started) fs->flusher_started = thread_start(fs, flusher);
+	if(log_mode(fs) && !fs->cleaner_started) fs->cleaner_started = thread_start(fs, cleaner);
 
 	// Find which blocks are in use by checking direct and indirect pointers
 	int inode_block;
-	for(inode_block = 0; inode_block < super_block.super.ninodeblocks; inode_block++){
-		free_block_bm[inode_block + 1] = false; // Inode blocks are not free
-		disk_read(inode_block + 1, block.data);
+	if(log_mode(fs)){
+		if(!log_mount(fs)){
+			log_release(fs);
+			return 0;
+		}
+		fs->scan_end = fs->mounted_super.ninodeblocks;
+	}else{
+		for(inode_block = 0; inode_block < super_block->super.ninodeblocks; inode_block++){
+			bitmap_clear(fs->free_block_bm, inode_block + 1); // Inode blocks are not free
+		}
+		fs->scan_end = inode_blocks_initialized(&fs->mounted_super);
 
-		// Check each inode in the block and check if it is valid
-		int inode;
-		for(inode = 0; inode < INODES_PER_BLOCK; inode++){
-			if(block.inode[inode].isvalid){
-				int size = block.inode[inode].size;
-				// Blocks pointed to by direct pointers
-				int direct;
-				for(direct = 0; direct < POINTERS_PER_INODE; direct++){
-					if(size <= 0) break;
-					if(block.inode[inode].direct[direct]){
-						free_block_bm[block.inode[inode].direct[direct]] = false;
-						size -= DISK_BLOCK_SIZE;
-					}
-				}
-				// Indirect block
-				if(size > 0 && block.inode[inode].indirect){
-					free_block_bm[block.inode[inode].indirect] = false;
+		// The scan below then reads the table from memory
+		if(fs->mounted_super.ninodeblocks <= fs->pin_limit) cache_pin(fs->cache, 1, fs->mounted_super.ninodeblocks);
+	}
+	fs->scan_next = 0;
+	fs->scan_generation++;
+	fs->is_mounted = true;
 
-					// Blocks pointed to by pointers in the indirect block
-					union fs_block indirect_block;
-					disk_read(block.inode[inode].indirect, indirect_block.data);
-					int indirect;
-					for(indirect = 0; indirect < POINTERS_PER_BLOCK; indirect++){
-						if(size <= 0) break;
-						if(indirect_block.pointers[indirect]){
-							free_block_bm[indirect_block.pointers[indirect]] = false;
-							size -= DISK_BLOCK_SIZE;
-						}
-					}
-				}
-			}
-		}
+	// A lazy mount returns now and leaves the scan to a thread, unless
+	// there is an intent log to replay first
+	if(lazy && !(fs->intent && intent_used(fs->intent) > 0)){
+		if(thread_start(fs, mount_scanner)) return 1;
+	}
+
+	for(; fs->scan_next < fs->scan_end; fs->scan_next++){
+		mount_scan_block(fs, fs->scan_next, block, indirect_block);
+	}
+	mount_scan_finish(fs, block);
+
+	// Synchronous writes the image may have missed are applied again, in
+	// order. Each one rewrites the same bytes, so it does no harm if the
+	// image already had it.
+	if(fs->intent && intent_used(fs->intent) > 0){
+		fs->intent_skipped = 0;
+		int n = intent_replay(fs->intent, intent_replay_one, fs) - fs->intent_skipped;
+		if(n > 0) printf("replayed %d synchronous writes from the intent log\n", n);
+		if(fs->intent_skipped > 0) printf("skipped %d synchronous writes to files that no longer exist\n", fs->intent_skipped);
+		intent_checkpoint(fs);
 	}
-	is_mounted = true;
 	return 1;
 }
 
-int fs_create(){
+int fs_mount( fs_t *fs ){
+	PROBE0(fs_mount_entry);
+	FS_RETURN(fs_mount, mount_disk(fs, false));
+}
+
+// Returns as soon as the superblock is read. Until the scan is done, files
+// are read by going to the inode table on disk. Overwrites and creates
+// that find a free inode in the scanned part of the table go ahead; block
+// allocation waits for the scan, since any inode not scanned yet may own
+// any block.
+int fs_mount_lazy( fs_t *fs ){
+	PROBE0(fs_mount_lazy_entry);
+	FS_RETURN(fs_mount_lazy, mount_disk(fs, true));
+}
+
+int fs_create( fs_t *fs ){
+	PROBE0(fs_create_entry);
+	SPAN("fs_create", -1);
+	FS_LOCKED;
 	// Mount is a prequisite
-	if(!is_mounted) return 0;
+	if(!fs->is_mounted) FS_RETURN(fs_create, 0);
+
+	// Place the inode in the first unused inumber. While a lazy mount is
+	// scanning, one in the part of the table already scanned will do; a log
+	// may need cleaning, which looks at the whole table.
+	int inumber = itable_find_free(&fs->inode_table, 1);
+	if(log_mode(fs) || !inumber || inode_block_unscanned(fs, inumber / INODES_PER_BLOCK)){
+		scan_wait(fs);
+		if(!fs->is_mounted) FS_RETURN(fs_create, 0);
+		inumber = itable_find_free(&fs->inode_table, 1);
+	}
+	if(!inumber) FS_RETURN(fs_create, 0); // No empty inodes = failure
+	if(log_mode(fs)) log_make_room(fs, 1);
 
-	// Place the inode in the first unused inumber
-	union fs_block super_block;
-	disk_read(0, super_block.data);
+	// Create and save the new inode in the open spot
 	struct fs_inode inode;
-	int inumber;
-	for(inumber = 1; inumber < super_block.super.ninodes; inumber++){
-		inode_load(inumber, &inode);
-		if(!inode.isvalid){ // Create and save the new inode in open spot
-			inode.isvalid = 1;
-			inode.size = 0;
-			int ptr;
-			for(ptr = 0; ptr < POINTERS_PER_INODE; ptr++){
-				inode.direct[ptr] = 0;
-			}
-			inode_save(inumber, &inode);
-			return inumber;
+	memset(&inode, 0, sizeof(inode));
+	inode.isvalid = 1;
+	inode_save(fs, inumber, &inode);
+	fs->creates++;
+	FS_RETURN(fs_create, inumber);
+}
+
+int fs_delete( fs_t *fs, int inumber ){
+	PROBE1(fs_delete_entry, inumber);
+	SPAN("fs_delete", inumber);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite and inumber must be in range of inodes
+	if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) FS_RETURN(fs_delete, 0);
+
+	// Records of the file in the intent log must not be replayed into a
+	// file created later under the same inumber
+	if(!intent_checkpoint(fs)) FS_RETURN(fs_delete, 0);
+
+	// Only the inode is written now. It stays on disk as an orphan that
+	// still owns its blocks until the reclaimer has freed them all, so the
+	// time taken does not depend on the size of the file.
+	if(log_mode(fs)) log_make_room(fs, 1);
+	struct fs_inode inode, orphan;
+	inode_load(fs, inumber, &inode);
+	orphan = inode;
+	orphan.isvalid = FS_INODE_ORPHAN;
+	inode_save(fs, inumber, &orphan);
+	orphan_add(fs, inumber, &inode);
+	FS_RETURN(fs_delete, 1);
+}
+
+// Create up to count inodes, returning how many were made and their
+// inumbers in ascending order
+int fs_create_many( fs_t *fs, int count, int *inumbers ){
+	PROBE1(fs_create_many_entry, count);
+	SPAN("fs_create_many", count);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite
+	if(!fs->is_mounted || count <= 0) FS_RETURN(fs_create_many, 0);
+
+	// Take the lowest unused inumbers
+	int n = 0, inumber = 1;
+	while(n < count && (inumber = itable_find_free(&fs->inode_table, inumber))){
+		inumbers[n++] = inumber++;
+	}
+	if(n == 0) FS_RETURN(fs_create_many, 0);
+
+	struct fs_inode *inodes = calloc(n, sizeof(struct fs_inode));
+	if(!inodes) FS_RETURN(fs_create_many, 0);
+	int i;
+	for(i = 0; i < n; i++){
+		inodes[i].isvalid = 1;
+	}
+
+	// Enough log room for every inode block touched
+	if(log_mode(fs)) log_make_room(fs, (inumbers[n - 1] - inumbers[0]) / INODES_PER_BLOCK + 2);
+	inode_save_many(fs, inumbers, inodes, n);
+	free(inodes);
+	fs->creates++;
+	FS_RETURN(fs_create_many, n);
+}
+
+int inumber_compare( const void *a, const void *b ){
+	return *(const int *)a - *(const int *)b;
+}
+
+// Delete every valid inode in the list, returning how many were deleted
+int fs_delete_many( fs_t *fs, const int *inumbers, int count ){
+	PROBE1(fs_delete_many_entry, count);
+	SPAN("fs_delete_many", count);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite
+	if(!fs->is_mounted || count <= 0) FS_RETURN(fs_delete_many, 0);
+
+	// Sort so inodes sharing a block are saved together, dropping
+	// duplicates and inumbers that are not in use
+	int *sorted = malloc(count * sizeof(int));
+	struct fs_inode *inodes = malloc(count * sizeof(struct fs_inode));
+	if(!sorted || !inodes){
+		free(sorted);
+		free(inodes);
+		FS_RETURN(fs_delete_many, 0);
+	}
+	memcpy(sorted, inumbers, count * sizeof(int));
+	qsort(sorted, count, sizeof(int), inumber_compare);
+	int n = 0, i;
+	for(i = 0; i < count; i++){
+		if(!is_valid_inumber(fs, sorted[i])) continue;
+		if(n > 0 && sorted[n - 1] == sorted[i]) continue;
+		sorted[n++] = sorted[i];
+	}
+	if(n == 0){
+		free(sorted);
+		free(inodes);
+		FS_RETURN(fs_delete_many, 0);
+	}
+
+	// As in fs_delete, turn them all into orphans for the reclaimer
+	if(!intent_checkpoint(fs)){
+		free(sorted);
+		free(inodes);
+		FS_RETURN(fs_delete_many, 0);
+	}
+	if(log_mode(fs)) log_make_room(fs, (sorted[n - 1] - sorted[0]) / INODES_PER_BLOCK + 2);
+	for(i = 0; i < n; i++){
+		inode_load(fs, sorted[i], &inodes[i]);
+		inodes[i].isvalid = FS_INODE_ORPHAN;
+	}
+	inode_save_many(fs, sorted, inodes, n);
+	for(i = 0; i < n; i++){
+		orphan_add(fs, sorted[i], &inodes[i]);
+	}
+	free(sorted);
+	free(inodes);
+	FS_RETURN(fs_delete_many, n);
+}
+
+int fs_trim( fs_t *fs ){
+	PROBE0(fs_trim_entry);
+	SPAN("fs_trim", -1);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite
+	if(!fs->is_mounted) FS_RETURN(fs_trim, -1);
+	orphans_drain(fs);
+	discard_flush(fs);
+
+	// Nothing on disk may point at a free block once the log is checkpointed
+	if(log_mode(fs)) log_checkpoint(fs);
+
+	// Discard every run of free blocks in one sweep of the bitmap
+	int trimmed = 0, start = -1, b;
+	for(b = 1; b <= fs->mounted_super.nblocks; b++){
+		bool isfree = b < fs->mounted_super.nblocks && bitmap_test(fs->free_block_bm, b);
+		if(isfree && start < 0){
+			start = b;
+		}else if(!isfree && start >= 0){
+			if(!cache_discard(fs->cache, start, b - start)) FS_RETURN(fs_trim, -1);
+			trimmed += b - start;
+			start = -1;
 		}
 	}
-	// If it gets here, no empty inodes = failure
-	return 0;
+
+	// Inode blocks past the watermark hold nothing either
+	int initialized = inode_blocks_initialized(&fs->mounted_super);
+	if(initialized < fs->mounted_super.ninodeblocks){
+		if(!cache_discard(fs->cache, initialized + 1, fs->mounted_super.ninodeblocks - initialized)) FS_RETURN(fs_trim, -1);
+		trimmed += fs->mounted_super.ninodeblocks - initialized;
+	}
+	FS_RETURN(fs_trim, trimmed);
 }
 
-int fs_delete( int inumber ){
-	// Mount is a prequisite and inumber must be in range of inodes
-	if(!is_mounted || !is_valid_inumber(inumber)) return 0;
+// Copy blocks in batches: all reads of a batch go out in block order, then
+// all writes, instead of alternating one read and one write
+#define RELOCATE_BATCH 64
+
+void relocate_copy( fs_t *fs, int *src, int *dst, int count ){
+	char *buffers[RELOCATE_BATCH];
+	int i;
+	for(i = 0; i < count; i++){
+		buffers[i] = pool_get();
+		block_read(fs, src[i], buffers[i], CACHE_DATA);
+	}
+	for(i = 0; i < count; i++){
+		cache_write(fs->cache, dst[i], buffers[i], CACHE_DATA);
+		pool_put(buffers[i]);
+	}
+}
+
+int fs_grow( fs_t *fs, int nblocks ){
+	int old = fs->mounted_super.nblocks;
+	if(!cache_resize(fs->cache, nblocks)) return 0;
+
+	uint64_t *bm = realloc(fs->free_block_bm, BITMAP_WORDS(nblocks) * sizeof(uint64_t));
+	if(!bm){
+		cache_resize(fs->cache, old);
+		return 0;
+	}
+	fs->free_block_bm = bm;
+
+	// Every new block starts out free
+	int b;
+	for(b = old; b < nblocks; b++){
+		bitmap_set(fs->free_block_bm, b);
+	}
+	fs->mounted_super.nblocks = nblocks;
+	alloc_init(&fs->block_alloc, fs->free_block_bm, nblocks, fs->mounted_super.ninodeblocks + 1, 1);
+	super_save(fs);
+	return 1;
+}
+
+int fs_shrink( fs_t *fs, int nblocks ){
+	int old = fs->mounted_super.nblocks;
+
+	// Queued discards may name blocks that are about to receive copies
+	discard_flush(fs);
+
+	// Count the used blocks that must move and the room there is for them
+	int used = 0, room = 0, b;
+	for(b = fs->mounted_super.ninodeblocks + 1; b < old; b++){
+		bool isfree = bitmap_test(fs->free_block_bm, b);
+		if(b < nblocks && isfree) room++;
+		if(b >= nblocks && !isfree) used++;
+	}
+	if(used > room) return 0;
+
+	// First copy every used block past the new end into a free block below
+	// it. Nothing points at the copies yet, so a crash here loses nothing.
+	int *moved = calloc(old - nblocks, sizeof(int));
+	if(!moved) return 0;
+	int src[RELOCATE_BATCH], dst[RELOCATE_BATCH];
+	int count = 0, target = fs->mounted_super.ninodeblocks + 1;
+	for(b = nblocks; b < old; b++){
+		if(bitmap_test(fs->free_block_bm, b)) continue;
+		while(!bitmap_test(fs->free_block_bm, target)) target++;
+		bitmap_clear(fs->free_block_bm, target);
+		moved[b - nblocks] = target;
+		src[count] = b;
+		dst[count] = target;
+		if(++count == RELOCATE_BATCH){
+			relocate_copy(fs, src, dst, count);
+			count = 0;
+		}
+	}
+	relocate_copy(fs, src, dst, count);
+
+	// With write-back on the copies may only be in the cache; they must be
+	// on disk before anything points at them
+	cache_flush(fs->cache, 0, INT_MAX);
+	if(!disk_sync(fs->disk)){
+		for(b = 0; b < old - nblocks; b++){
+			if(moved[b]) alloc_free(&fs->block_alloc, moved[b]);
+		}
+		free(moved);
+		return 0;
+	}
 
-	// First mark all data and indirect blocks for this inode free
+	// Then point each inode at the copies, indirect block before inode
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
 	struct fs_inode inode;
-	inode_load(inumber, &inode);
-	// Free direct pointers
-	int direct;
-	for(direct = 0; direct < POINTERS_PER_INODE; direct++){
-		if(inode.size <= 0) break;
-		if(inode.direct[direct]){
-			free_block_bm[inode.direct[direct]] = true;
-			inode.size -= DISK_BLOCK_SIZE;
-		}
-	}
-	// Free indirect block and indirect pointer blocks
-	if(inode.size > 0 && inode.indirect){
-		free_block_bm[inode.indirect] = true;
-		union fs_block indirect_block;
-		disk_read(inode.indirect, indirect_block.data);
-		int indirect;
-		for(indirect = 0; indirect < POINTERS_PER_BLOCK; indirect++){
-			if(inode.size <= 0) break;
-			if(indirect_block.pointers[indirect]){
-				free_block_bm[indirect_block.pointers[indirect]] = true;
-				inode.size -= DISK_BLOCK_SIZE;
+	int inumber, ptr;
+	for(inumber = 1; inumber < fs->mounted_super.ninodes; inumber++){
+		if(!itable_valid(&fs->inode_table, inumber)) continue;
+		inode_load(fs, inumber, &inode);
+		bool changed = false;
+
+		// Same walk as inode_mark_blocks, so only owned blocks are touched
+		int remaining = ceil((double)inode.size / DISK_BLOCK_SIZE);
+		for(ptr = 0; ptr < POINTERS_PER_INODE && remaining > 0; ptr++){
+			if(!inode.direct[ptr]) continue;
+			remaining--;
+			if(inode.direct[ptr] >= nblocks){
+				inode.direct[ptr] = moved[inode.direct[ptr] - nblocks];
+				changed = true;
+			}
+		}
+		if(remaining > 0 && inode.indirect){
+			if(inode.indirect >= nblocks){
+				inode.indirect = moved[inode.indirect - nblocks];
+				changed = true;
+			}
+			block_read(fs, inode.indirect, indirect_block->data, CACHE_META);
+			bool indirect_changed = false;
+			for(ptr = 0; ptr < POINTERS_PER_BLOCK && remaining > 0; ptr++){
+				int p = indirect_block->pointers[ptr];
+				if(!p) continue;
+				remaining--;
+				if(p >= nblocks && p < old){
+					indirect_block->pointers[ptr] = moved[p - nblocks];
+					indirect_changed = true;
+				}
 			}
+			if(indirect_changed) cache_write(fs->cache, inode.indirect, indirect_block->data, CACHE_META);
 		}
+		if(changed) inode_save(fs, inumber, &inode);
 	}
+	free(moved);
 
-	// Delete the inode by setting it invalid
-	inode.isvalid = 0;
-	inode_save(inumber, &inode);
+	// The old blocks may only go once the new pointers are on disk, and
+	// the image only shrinks under a super block that says so
+	if(!disk_sync(fs->disk)) return 0;
+	fs->mounted_super.nblocks = nblocks;
+	super_save(fs);
+	if(!disk_sync(fs->disk)) return 0;
+	cache_resize(fs->cache, nblocks);
+	uint64_t *bm = realloc(fs->free_block_bm, BITMAP_WORDS(nblocks) * sizeof(uint64_t));
+	if(bm) fs->free_block_bm = bm;
+	alloc_init(&fs->block_alloc, fs->free_block_bm, nblocks, fs->mounted_super.ninodeblocks + 1, 1);
 	return 1;
 }
 
-int fs_getsize( int inumber ){
+int fs_resize( fs_t *fs, int nblocks ){
+	PROBE1(fs_resize_entry, nblocks);
+	SPAN("fs_resize", nblocks);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite and the inode table must stay whole, with at
+	// least one data block after it
+	if(!fs->is_mounted) FS_RETURN(fs_resize, 0);
+	if(nblocks < fs->mounted_super.ninodeblocks + 2) FS_RETURN(fs_resize, 0);
+	if(log_mode(fs)) FS_RETURN(fs_resize, 0); // Segments are not relocated
+
+	// Blocks of deleted files must be free before any are moved
+	orphans_drain(fs);
+	discard_flush(fs);
+
+	if(nblocks > fs->mounted_super.nblocks) FS_RETURN(fs_resize, fs_grow(fs, nblocks));
+	if(nblocks < fs->mounted_super.nblocks) FS_RETURN(fs_resize, fs_shrink(fs, nblocks));
+	FS_RETURN(fs_resize, 1);
+}
+
+// Takes effect at the next mount. A log-structured inode table has no
+// fixed place on disk, so it is never pinned.
+void fs_pin_inodes( fs_t *fs, int maxblocks ){
+	PROBE1(fs_pin_inodes_entry, maxblocks);
+	FS_LOCKED;
+	fs->pin_limit = maxblocks;
+	PROBE0(fs_pin_inodes_return);
+}
+
+// Record synchronous writes in an intent log on the given disk, or stop
+// with a null disk. Only while unmounted, so a log left over from a crash
+// is replayed at the next mount.
+int fs_intent_log( fs_t *fs, disk_t *log ){
+	PROBE1(fs_intent_log_entry, log ? disk_size(log) : 0);
+	FS_LOCKED;
+	if(fs->is_mounted) FS_RETURN(fs_intent_log, 0);
+	if(fs->intent){
+		intent_close(fs->intent);
+		fs->intent = 0;
+	}
+	if(!log) FS_RETURN(fs_intent_log, 1);
+	fs->intent = intent_open(log);
+	FS_RETURN(fs_intent_log, fs->intent != 0);
+}
+
+// Expiry in ms for dirty data, 0 for write-through, and the share of the
+// data cache in percent that may be dirty
+void fs_writeback( fs_t *fs, int expire, int ratio ){
+	PROBE2(fs_writeback_entry, expire, ratio);
+	FS_LOCKED;
+	fs->dirty_expire = expire;
+	fs->dirty_ratio = ratio < 1 ? 1 : ratio > 100 ? 100 : ratio;
+	cache_set_writeback(fs->cache, expire > 0);
+	PROBE0(fs_writeback_return);
+}
+
+// Everything written so far is made durable: dirty data, in log mode the
+// segment being filled and the inode map, then a sync of the image
+int fs_sync( fs_t *fs ){
+	PROBE0(fs_sync_entry);
+	SPAN("fs_sync", -1);
+	FS_LOCKED;
+	// Mount is a prequisite
+	if(!fs->is_mounted) FS_RETURN(fs_sync, 0);
+
+	cache_flush(fs->cache, 0, INT_MAX);
+	if(log_mode(fs)) log_checkpoint(fs);
+	FS_RETURN(fs_sync, image_commit(fs));
+}
+
+// Like fs_sync, but only writes out the data blocks of one file. The inode
+// and indirect block are written through already. Concurrent calls share
+// the sync of the image, so this is called with the lock held once:
+// group_commit lets go of it while waiting.
+int file_sync( fs_t *fs, int inumber ){
+	// Mount is a prequisite and inumber must be in range of inodes
+	if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) return 0;
+
+	// A log is made durable as a whole
+	if(log_mode(fs)){
+		log_checkpoint(fs);
+		return image_commit(fs);
+	}
+
+	struct fs_inode inode;
+	inode_load(fs, inumber, &inode);
+	int nblocks = ceil((double)inode.size / DISK_BLOCK_SIZE);
+	int *blocknums = malloc((POINTERS_PER_INODE + POINTERS_PER_BLOCK) * sizeof(int));
+	if(!blocknums) return 0;
+
+	int n = 0, ptr;
+	for(ptr = 0; ptr < POINTERS_PER_INODE && n < nblocks; ptr++){
+		if(inode.direct[ptr]) blocknums[n++] = inode.direct[ptr];
+	}
+	if(n < nblocks && inode.indirect){
+		union fs_block *indirect_block POOL_SCOPED = pool_get();
+		block_read(fs, inode.indirect, indirect_block->data, CACHE_META);
+		for(ptr = 0; ptr < POINTERS_PER_BLOCK && n < nblocks; ptr++){
+			if(indirect_block->pointers[ptr]) blocknums[n++] = indirect_block->pointers[ptr];
+		}
+	}
+	cache_flush_blocks(fs->cache, blocknums, n);
+	free(blocknums);
+	return image_commit(fs);
+}
+
+int fs_fsync( fs_t *fs, int inumber ){
+	PROBE1(fs_fsync_entry, inumber);
+	SPAN("fs_fsync", inumber);
+	FS_LOCKED;
+	FS_RETURN(fs_fsync, file_sync(fs, inumber));
+}
+
+void fs_sync_stats( fs_t *fs, struct fs_sync_stats *stats ){
+	PROBE0(fs_sync_stats_entry);
+	FS_LOCKED;
+	stats->calls = fs->sync_calls;
+	stats->flushes = fs->sync_main.flushes;
+	stats->intent_writes = fs->intent_writes;
+	stats->intent_flushes = fs->sync_intent.flushes;
+	stats->intent_checkpoints = fs->intent_checkpoints;
+	PROBE0(fs_sync_stats_return);
+}
+
+int fs_unmount( fs_t *fs ){
+	PROBE0(fs_unmount_entry);
+	SPAN("fs_unmount", -1);
+	FS_LOCKED;
+	// Mount is a prequisite
+	if(!fs->is_mounted) FS_RETURN(fs_unmount, 0);
+
+	// Ends a lazy mount's scan if it is still running
+	fs->scan_generation++;
+	fs->scan_next = fs->scan_end = 0;
+	pthread_cond_broadcast(&fs->scan_done);
+
+	orphans_drain(fs);
+	discard_flush(fs);
+	cache_flush(fs->cache, 0, INT_MAX);
+	if(log_mode(fs)) log_checkpoint(fs);
+	intent_checkpoint(fs);
+	if(log_mode(fs)) log_release(fs);
+	cache_unpin(fs->cache);
+	free(fs->free_block_bm);
+	fs->free_block_bm = 0;
+	itable_free(&fs->inode_table);
+	memset(fs->advice, 0, sizeof(fs->advice));
+	fs->is_mounted = false;
+	FS_RETURN(fs_unmount, 1);
+}
+
+int fs_getsize( fs_t *fs, int inumber ){
+	PROBE1(fs_getsize_entry, inumber);
+	FS_LOCKED;
 	// Mount is a prequisite and inumber must be in range of inodes
-	if(!is_mounted || !is_valid_inumber(inumber)) return -1;
+	if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) FS_RETURN(fs_getsize, -1);
 
-	// Load the inode and return its logical size
+	// The logical size is kept in the inode table
 	struct fs_inode inode;
-	inode_load(inumber, &inode);
-	return inode.size;
+	inode_load(fs, inumber, &inode);
+	FS_RETURN(fs_getsize, inode.size);
+}
+
+int fs_stat( fs_t *fs, int *ninodes, int *nfree, int *ndeleting, long long *used ){
+	PROBE0(fs_stat_entry);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite
+	if(!fs->is_mounted) FS_RETURN(fs_stat, 0);
+
+	// Whole-table queries run over the inode table columns
+	*ninodes = itable_count_valid(&fs->inode_table);
+	*ndeleting = itable_count_orphans(&fs->inode_table); // Blocks not all freed yet
+	*nfree = (fs->inode_table.ninodes - 1) - *ninodes - *ndeleting; // Of all but inode 0, which is never handed out
+	*used = itable_used_bytes(&fs->inode_table);
+	FS_RETURN(fs_stat, 1);
 }
 
-int fs_read( int inumber, char *data, int length, int offset ){
+int fs_find( fs_t *fs, int minsize, int *inumbers, int max ){
+	PROBE2(fs_find_entry, minsize, max);
+	FS_LOCKED;
+	scan_wait(fs);
+	// Mount is a prequisite
+	if(!fs->is_mounted) FS_RETURN(fs_find, -1);
+
+	FS_RETURN(fs_find, itable_find_at_least(&fs->inode_table, minsize, inumbers, max));
+}
+
+// The data block holding block ptr of a file, or 0 past its end. The
+// indirect block is read on first use.
+int file_block( fs_t *fs, struct fs_inode *inode, union fs_block *indirect_block, bool *indirect_loaded, int ptr ){
+	if(ptr < POINTERS_PER_INODE) return inode->direct[ptr];
+	if(!inode->indirect || ptr - POINTERS_PER_INODE >= POINTERS_PER_BLOCK) return 0;
+	if(!*indirect_loaded){
+		block_read(fs, inode->indirect, indirect_block->data, CACHE_META);
+		*indirect_loaded = true;
+	}
+	return indirect_block->pointers[ptr - POINTERS_PER_INODE];
+}
+
+// Apply a cache action to logical blocks first to last of a file, one run
+// of blocks that are consecutive on disk at a time. Blocks still in the
+// log segment being filled are not on disk yet and are left alone.
+#define ADVISE_PREFETCH      0
+#define ADVISE_PREFETCH_ONCE 1
+#define ADVISE_RELEASE       2
+#define ADVISE_RUN           64
+
+void advise_blocks( fs_t *fs, struct fs_inode *inode, union fs_block *indirect_block, bool *indirect_loaded, int first, int last, int action ){
+	int last_block = (inode->size - 1) / DISK_BLOCK_SIZE;
+	if(inode->size == 0) return;
+	if(last > last_block) last = last_block;
+
+	int ptr = first;
+	while(ptr <= last){
+		int b = file_block(fs, inode, indirect_block, indirect_loaded, ptr);
+		if(!b) break;
+		if(log_buffered(fs, b)){
+			ptr++;
+			continue;
+		}
+		int count = 1;
+		while(ptr + count <= last && count < ADVISE_RUN
+			&& file_block(fs, inode, indirect_block, indirect_loaded, ptr + count) == b + count
+			&& !log_buffered(fs, b + count)) count++;
+		if(action == ADVISE_RELEASE){
+			cache_release(fs->cache, b, count);
+		}else{
+			cache_prefetch(fs->cache, b, count, action == ADVISE_PREFETCH_ONCE);
+		}
+		ptr += count;
+	}
+}
+
+// Sequential readers get blocks read ahead of them, in a window that
+// doubles each time they keep going, and starts over when they jump
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX 128
+
+void read_ahead( fs_t *fs, struct advice *a, struct fs_inode *inode, union fs_block *indirect_block, bool *indirect_loaded, int first, int last ){
+	SPAN("read_ahead", first);
+	if(first != a->next || a->window == 0){
+		a->window = READAHEAD_MIN;
+		a->ahead = first;
+	}
+	a->next = last + 1;
+	if(a->ahead > last + a->window / 2) return; // Still far enough ahead
+
+	int from = a->ahead > first ? a->ahead : first;
+	a->ahead = last + 1 + a->window;
+	advise_blocks(fs, inode, indirect_block, indirect_loaded, from, a->ahead - 1,
+		a->hints & FS_ADVISE_NOREUSE ? ADVISE_PREFETCH_ONCE : ADVISE_PREFETCH);
+	if(a->window < READAHEAD_MAX) a->window *= 2;
+}
+
+// Reads of at least this much that start on a block boundary go around the cache
+#define DIRECT_READ_MIN (64 * DISK_BLOCK_SIZE)
+// Most blocks read around the cache in one request
+#define DIRECT_READ_RUN 256
+
+int file_read( fs_t *fs, int inumber, char *data, int length, int offset, bool direct ){
+	SPAN("file_read", inumber);
 	// Mount is a prequisite and inumber must be in range of inodes
-	if(!is_mounted || !is_valid_inumber(inumber)) return 0;
+	if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) return 0;
 	// Don't try to read anything if there is nothing to read or invalid offset
 	if(length <= 0 || offset < 0) return 0;
 
 	// Load the inode and size
 	struct fs_inode inode;
-	inode_load(inumber, &inode);
+	inode_load(fs, inumber, &inode);
 	int size = inode.size;
 	if(offset >= size) return 0;
+	if(length > size - offset) length = size - offset;
+	if(length >= DIRECT_READ_MIN && offset % DISK_BLOCK_SIZE == 0) direct = true;
 
-	// Create a list of the data blocks pointed to by the direct and indirect pointer
-	union fs_block super_block, block;
-	disk_read(0, super_block.data);
-	bool *blocks = malloc(super_block.super.nblocks * sizeof(bool));
-	memset(blocks, false, super_block.super.nblocks * sizeof(bool)); // Initialize to false
-	int dptr;
-	for(dptr = 0; dptr < POINTERS_PER_INODE; dptr++){ // Blocks by direct pointers
-		if(size <= 0) break;
-		if(inode.direct[dptr]){
-			blocks[inode.direct[dptr]] = true;
-			size -= DISK_BLOCK_SIZE;
-		}
-	}
-	if(size > 0 && inode.indirect){
-		union fs_block indirect_block;
-		disk_read(inode.indirect, indirect_block.data);
-		int iptr;
-		for(iptr = 0; iptr < POINTERS_PER_BLOCK; iptr++){ // blocks by indirect
-			if(size <= 0) break;
-			if(indirect_block.pointers[iptr]){
-				blocks[indirect_block.pointers[iptr]] = true;
-				size -= DISK_BLOCK_SIZE;
-			}
-		}
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
+	bool indirect_loaded = false;
+
+	struct advice *a = advice_find(fs, inumber, offset);
+	int hints = a ? a->hints : 0;
+	if(!direct && (hints & FS_ADVISE_SEQUENTIAL)){
+		read_ahead(fs, a, &inode, indirect_block, &indirect_loaded, offset / DISK_BLOCK_SIZE, (offset + length - 1) / DISK_BLOCK_SIZE);
 	}
-	size = inode.size;
 
-	// Read the blocks that are found to be used by the inode
-	int offset_ptr = floor(offset / DISK_BLOCK_SIZE);
-	int read_counter = 0, n_block = 0, block_offset;
-	int b;
-	for(b = 0; b < super_block.super.nblocks; b++){
-		if(length <= 0 || size <= 0) break;
-		else if(blocks[b]){
-			if(offset_ptr == n_block){
-				block_offset = (offset - (offset_ptr * DISK_BLOCK_SIZE)) % DISK_BLOCK_SIZE;
-				// Read the data block and add the appropriate part to the data
-				disk_read(b, block.data);
-				if(size < DISK_BLOCK_SIZE){
-					memcpy(data + read_counter, block.data + block_offset, size);
-					read_counter += size;
-					break;
-				}else if(block_offset + length < DISK_BLOCK_SIZE){
-					memcpy(data + read_counter, block.data + block_offset, length);
-					read_counter += length;
-					break;
-				}else{
-					memcpy(data + read_counter, block.data + block_offset, DISK_BLOCK_SIZE - block_offset);
-					read_counter += (DISK_BLOCK_SIZE - block_offset);
-					length -= (DISK_BLOCK_SIZE - block_offset);
-				}
-				offset_ptr++;
-			}
-			size -= DISK_BLOCK_SIZE;
-			n_block++;
+	// Follow the direct and indirect pointers for each block the request covers
+	int read_counter = 0, block_offset, block_num, chunk;
+	int offset_ptr = offset / DISK_BLOCK_SIZE;
+	while(length > 0){
+		block_num = file_block(fs, &inode, indirect_block, &indirect_loaded, offset_ptr);
+		if(!block_num) break;
+		block_offset = offset % DISK_BLOCK_SIZE;
+
+		// Whole blocks that follow each other on disk go from the disk to
+		// the caller in one request
+		if(direct && block_offset == 0 && length >= DISK_BLOCK_SIZE && !log_buffered(fs, block_num)){
+			int count = 1;
+			while(count < DIRECT_READ_RUN && length >= (count + 1) * DISK_BLOCK_SIZE
+				&& file_block(fs, &inode, indirect_block, &indirect_loaded, offset_ptr + count) == block_num + count
+				&& !log_buffered(fs, block_num + count)) count++;
+			cache_read_direct(fs->cache, block_num, count, data + read_counter);
+			read_counter += count * DISK_BLOCK_SIZE;
+			offset += count * DISK_BLOCK_SIZE;
+			length -= count * DISK_BLOCK_SIZE;
+			offset_ptr += count;
+			continue;
 		}
+
+		// Read the data block and add the appropriate part to the data
+		chunk = DISK_BLOCK_SIZE - block_offset;
+		if(chunk > length) chunk = length;
+		if((hints & FS_ADVISE_NOREUSE) && !log_buffered(fs, block_num)){
+			cache_read_once(fs->cache, block_num, block->data);
+		}else{
+			block_read(fs, block_num, block->data, CACHE_DATA);
+		}
+		memcpy(data + read_counter, block->data + block_offset, chunk);
+		read_counter += chunk;
+		offset += chunk;
+		length -= chunk;
+		offset_ptr++;
 	}
-	free(blocks);
 	return read_counter;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset ){
+// Hints for the bytes offset to offset+length of a file, or to its end for
+// a length of 0. SEQUENTIAL, RANDOM and NOREUSE stay with the file until
+// it is advised again, one range per file; WILLNEED and DONTNEED act on
+// the cache now.
+int fs_advise( fs_t *fs, int inumber, int offset, int length, int hints ){
+	PROBE4(fs_advise_entry, inumber, offset, length, hints);
+	SPAN("fs_advise", inumber);
+	FS_LOCKED;
+	// Mount is a prequisite and inumber must be in range of inodes
+	if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) FS_RETURN(fs_advise, 0);
+	if(offset < 0 || length < 0) FS_RETURN(fs_advise, 0);
+	if((hints & FS_ADVISE_SEQUENTIAL) && (hints & FS_ADVISE_RANDOM)) FS_RETURN(fs_advise, 0);
+
+	int kept = hints & (FS_ADVISE_SEQUENTIAL | FS_ADVISE_RANDOM | FS_ADVISE_NOREUSE);
+	if(kept){
+		struct advice *a = advice_slot(fs, inumber);
+		a->hints = kept;
+		a->start = offset;
+		a->end = length ? offset + length : 0;
+		a->next = -1;
+		a->window = 0;
+		a->used = ++fs->advice_clock;
+	}else if(!(hints & (FS_ADVISE_WILLNEED | FS_ADVISE_DONTNEED))){
+		advice_forget(fs, inumber); // NORMAL
+	}
+
+	if(hints & (FS_ADVISE_WILLNEED | FS_ADVISE_DONTNEED)){
+		struct fs_inode inode;
+		inode_load(fs, inumber, &inode);
+		union fs_block *indirect_block POOL_SCOPED = pool_get();
+		bool indirect_loaded = false;
+		int first = offset / DISK_BLOCK_SIZE;
+		int last = length ? (offset + length - 1) / DISK_BLOCK_SIZE : INT_MAX;
+		advise_blocks(fs, &inode, indirect_block, &indirect_loaded, first, last,
+			hints & FS_ADVISE_DONTNEED ? ADVISE_RELEASE : ADVISE_PREFETCH);
+	}
+	FS_RETURN(fs_advise, 1);
+}
+
+// Large reads that start on a block boundary go around the cache on their own
+int fs_read( fs_t *fs, int inumber, char *data, int length, int offset ){
+	PROBE3(fs_read_entry, inumber, offset, length);
+	SPAN("fs_read", inumber);
+	FS_LOCKED;
+	FS_RETURN(fs_read, file_read(fs, inumber, data, length, offset, false));
+}
+
+// Whole blocks are read straight from the disk, whatever the size of the read
+int fs_read_direct( fs_t *fs, int inumber, char *data, int length, int offset ){
+	PROBE3(fs_read_direct_entry, inumber, offset, length);
+	SPAN("fs_read_direct", inumber);
+	FS_LOCKED;
+	FS_RETURN(fs_read_direct, file_read(fs, inumber, data, length, offset, true));
+}
+
+bool write_extends( fs_t *fs, int inumber, int length, int offset ){
+	struct fs_inode inode;
+	inode_load(fs, inumber, &inode);
+	return (long long)offset + length > inode.size;
+}
+
+// Called with the lock held
+int file_write( fs_t *fs, int inumber, const char *data, int length, int offset ){
+	SPAN("file_write", inumber);
 	// Mount is a prequisite and inumber must be in range of inodes
-	if(!is_mounted || !is_valid_inumber(inumber)) return 0;
+	if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) return 0;
 	// Don't try to read anything if there is nothing to read or invalid offset
 	if(length <= 0 || offset < 0) return 0;
 
+	// Overwrites within a file allocate nothing, so only writes that extend
+	// it, and every write to a log, wait for a lazy mount's scan
+	if(fs->scan_next < fs->scan_end && (log_mode(fs) || write_extends(fs, inumber, length, offset))){
+		scan_wait(fs);
+		if(!fs->is_mounted || !is_valid_inumber(fs, inumber)) return 0;
+	}
+	if(log_mode(fs)) return log_write(fs, inumber, data, length, offset);
+
 	// Load the inode, size, and ptr info
 	struct fs_inode inode;
-	inode_load(inumber, &inode);
+	inode_load(fs, inumber, &inode);
 	int size = inode.size;
 
-	union fs_block block, indirect_block;
+	union fs_block *block POOL_SCOPED = pool_get();
+	union fs_block *indirect_block POOL_SCOPED = pool_get();
 
 	// Get counts of types of free pointers in the inode
 	int pointers_used = ceil((double)size / DISK_BLOCK_SIZE);
 	bool has_indirect = false;
 	if(pointers_used > POINTERS_PER_INODE){
 		has_indirect = true;
-		disk_read(inode.indirect, indirect_block.data);
+		block_read(fs, inode.indirect, indirect_block->data, CACHE_META);
 	}
 
 	// Start filling in the data overwriting
@@ -427,22 +2292,22 @@ int fs_write( int inumber, const char *data, int length, int offset ){
 		if(offset_ptr < POINTERS_PER_INODE){
 			block_num = inode.direct[offset_ptr];
 		}else{
-			block_num = indirect_block.pointers[offset_ptr - POINTERS_PER_INODE];
+			block_num = indirect_block->pointers[offset_ptr - POINTERS_PER_INODE];
 		}
 		//Copy the chunk of data into a block
 		block_offset = (offset - (offset_ptr * DISK_BLOCK_SIZE)) % DISK_BLOCK_SIZE;
 		if(block_offset + length < DISK_BLOCK_SIZE){
-			memcpy(block.data + block_offset, data + write_counter, length);
+			memcpy(block->data + block_offset, data + write_counter, length);
 			write_counter += length;
 			size -= length;
 			length = 0;
 		}else{
-			memcpy(block.data + block_offset, data + write_counter, DISK_BLOCK_SIZE - block_offset);
+			memcpy(block->data + block_offset, data + write_counter, DISK_BLOCK_SIZE - block_offset);
 			write_counter += (DISK_BLOCK_SIZE - block_offset);
 			size -= (DISK_BLOCK_SIZE - block_offset);
 			length -= (DISK_BLOCK_SIZE - block_offset);
 		}
-		disk_write(block_num, block.data);
+		cache_write(fs->cache, block_num, block->data, CACHE_DATA);
 		offset_ptr++;
 		if(length <= 0){
 			return write_counter;
@@ -460,31 +2325,35 @@ int fs_write( int inumber, const char *data, int length, int offset ){
 		free_indirect = POINTERS_PER_BLOCK - (pointers_used - POINTERS_PER_INODE);
 	}
 
-	union fs_block super_block;
-	disk_read(0, super_block.data);
+	// Blocks queued for discard may be handed out again below
+	discard_flush(fs);
 
 	// Start filling data into open blocks
-	int b;
-	for(b = super_block.super.ninodeblocks; b < super_block.super.nblocks; b++){
-		if(length <= 0) break;
-		else if(!free_block_bm[b]) continue;
-		free_block_bm[b] = false;
+	while(length > 0){
+		int b = block_alloc(fs);
+		if(b < 0){
+			// Out of space: finish freeing deleted files and look again
+			if(fs->norphans == 0) break;
+			orphans_drain(fs);
+			discard_flush(fs);
+			continue;
+		}
 		// Allocate an indirect block if necessary
 		if(free_direct == 0 && !has_indirect){
 			inode.indirect = b;
-			inode_save(inumber, &inode);
+			inode_save(fs, inumber, &inode);
 			has_indirect = true;
 			continue;
 		}
 		// Copy the chunk of data into a block
 		block_offset = (offset - (offset_ptr * DISK_BLOCK_SIZE)) % DISK_BLOCK_SIZE;
 		if(block_offset + length < DISK_BLOCK_SIZE){
-			memcpy(block.data + block_offset, data + write_counter, length);
+			memcpy(block->data + block_offset, data + write_counter, length);
 			write_counter += length;
 			inode.size += length;
 			length = 0;
 		}else{
-			memcpy(block.data + block_offset, data + write_counter, DISK_BLOCK_SIZE - block_offset);
+			memcpy(block->data + block_offset, data + write_counter, DISK_BLOCK_SIZE - block_offset);
 			write_counter += (DISK_BLOCK_SIZE - block_offset);
 			inode.size += (DISK_BLOCK_SIZE - block_offset);
 			length -= (DISK_BLOCK_SIZE - block_offset);
@@ -494,14 +2363,56 @@ int fs_write( int inumber, const char *data, int length, int offset ){
 			inode.direct[(POINTERS_PER_INODE - free_direct) % POINTERS_PER_INODE] = b;
 			free_direct--;
 		}else if(has_indirect && free_indirect > 0){
-			disk_read(inode.indirect, indirect_block.data);
-			indirect_block.pointers[(POINTERS_PER_BLOCK - free_indirect) % POINTERS_PER_BLOCK] = b;
-			disk_write(inode.indirect, indirect_block.data);
+			SPAN("indirect_update", inode.indirect);
+			block_read(fs, inode.indirect, indirect_block->data, CACHE_META);
+			indirect_block->pointers[(POINTERS_PER_BLOCK - free_indirect) % POINTERS_PER_BLOCK] = b;
+			cache_write(fs->cache, inode.indirect, indirect_block->data, CACHE_META);
 			free_indirect--;
 		}
-		inode_save(inumber, &inode);
-		disk_write(b, block.data);
+		inode_save(fs, inumber, &inode);
+		cache_write(fs->cache, b, block->data, CACHE_DATA);
 		offset_ptr++;
 	}
 	return write_counter;
 }
+
+int fs_write( fs_t *fs, int inumber, const char *data, int length, int offset ){
+	PROBE3(fs_write_entry, inumber, offset, length);
+	SPAN("fs_write", inumber);
+	dirty_throttle(fs);
+	FS_LOCKED;
+	FS_RETURN(fs_write, file_write(fs, inumber, data, length, offset));
+}
+
+// Like fs_write, but durable when it returns; -1 if it could not be made
+// so. With an intent log that takes one append to the log and a sync of
+// it, shared with concurrent callers, and the image catches up later.
+// Without one the file is synced in place.
+int fs_write_sync( fs_t *fs, int inumber, const char *data, int length, int offset ){
+	PROBE3(fs_write_sync_entry, inumber, offset, length);
+	SPAN("fs_write_sync", inumber);
+	dirty_throttle(fs);
+	FS_LOCKED;
+	int written = file_write(fs, inumber, data, length, offset);
+	if(written <= 0) FS_RETURN(fs_write_sync, written);
+	if(!fs->intent) FS_RETURN(fs_write_sync, file_sync(fs, inumber) ? written : -1);
+
+	// Replay can only write to a file the image has, so files created
+	// since the image was last synced get there before their first record
+	long long creates = fs->creates;
+	if(fs->creates_synced < creates){
+		if(log_mode(fs)) log_checkpoint(fs);
+		if(!image_commit(fs)) FS_RETURN(fs_write_sync, -1);
+		if(fs->creates_synced < creates) fs->creates_synced = creates;
+	}
+
+	// A full log is checkpointed to make room; a write bigger than the
+	// whole log goes to the image instead
+	if(!intent_append(fs->intent, inumber, data, written, offset)){
+		if(!intent_checkpoint(fs)) FS_RETURN(fs_write_sync, -1);
+		if(!intent_append(fs->intent, inumber, data, written, offset)) FS_RETURN(fs_write_sync, image_commit(fs) ? written : -1);
+	}
+	fs->intent_writes++;
+	if(intent_half_full(fs)) pthread_cond_signal(&fs->flush_wake);
+	FS_RETURN(fs_write_sync, group_commit(fs, &fs->sync_intent, intent_disk(fs->intent)) ? written : -1);
+}
@@ -1,15 +1,74 @@
 #ifndef FS_H
 #define FS_H
 
-void fs_debug();
-int  fs_format();
-int  fs_mount();
+#include "disk.h"
+#include "cache.h"
 
-int  fs_create();
-int  fs_delete( int inumber );
-int  fs_getsize();
+// Every call takes the file system instance it works on. An instance sits
+// on one disk, owns the block cache in front of it and any background
+// threads, and may be called from several threads at once.
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+typedef struct fs fs_t;
+
+// Calls to fs_sync, fs_fsync and fs_write_sync, and the disk syncs they
+// were served by. Synchronous writes that went to the intent log count
+// against its syncs instead, and a checkpoint syncs the image.
+struct fs_sync_stats {
+	long long calls;
+	long long flushes;
+	long long intent_writes;
+	long long intent_flushes;
+	long long intent_checkpoints;
+};
+
+// Access hints for fs_advise, which may be combined. SEQUENTIAL reads
+// ahead of the reader, RANDOM does not, WILLNEED reads the range in now,
+// DONTNEED lets go of it, and NOREUSE reads without keeping the blocks
+// in the cache for long.
+#define FS_ADVISE_NORMAL     0
+#define FS_ADVISE_SEQUENTIAL 1
+#define FS_ADVISE_RANDOM     2
+#define FS_ADVISE_WILLNEED   4
+#define FS_ADVISE_DONTNEED   8
+#define FS_ADVISE_NOREUSE    16
+
+fs_t *fs_open( disk_t *disk );
+void  fs_close( fs_t *fs );
+
+// The block cache is only reached through these, which hold the instance
+// lock against the background threads. fs_cache_size writes back what is
+// dirty before resizing; a size of 0 turns that part of the cache off.
+int  fs_cache_size( fs_t *fs, int capacity, int meta_capacity );
+void fs_cache_stats( fs_t *fs, struct cache_stats *stats );
+int  fs_cache_trace( fs_t *fs, const char *filename );
+
+void fs_debug( fs_t *fs );
+int  fs_format( fs_t *fs );
+int  fs_format_log( fs_t *fs );
+int  fs_mount( fs_t *fs );
+int  fs_mount_lazy( fs_t *fs );
+int  fs_unmount( fs_t *fs );
+int  fs_trim( fs_t *fs );
+int  fs_resize( fs_t *fs, int nblocks );
+void fs_pin_inodes( fs_t *fs, int maxblocks );
+void fs_writeback( fs_t *fs, int expire, int ratio );
+int  fs_sync( fs_t *fs );
+int  fs_fsync( fs_t *fs, int inumber );
+void fs_sync_stats( fs_t *fs, struct fs_sync_stats *stats );
+int  fs_intent_log( fs_t *fs, disk_t *log );
+
+int  fs_create( fs_t *fs );
+int  fs_delete( fs_t *fs, int inumber );
+int  fs_create_many( fs_t *fs, int count, int *inumbers );
+int  fs_delete_many( fs_t *fs, const int *inumbers, int count );
+int  fs_getsize( fs_t *fs, int inumber );
+int  fs_stat( fs_t *fs, int *ninodes, int *nfree, int *ndeleting, long long *used );
+int  fs_find( fs_t *fs, int minsize, int *inumbers, int max );
+
+int  fs_read( fs_t *fs, int inumber, char *data, int length, int offset );
+int  fs_read_direct( fs_t *fs, int inumber, char *data, int length, int offset );
+int  fs_advise( fs_t *fs, int inumber, int offset, int length, int hints );
+int  fs_write( fs_t *fs, int inumber, const char *data, int length, int offset );
+int  fs_write_sync( fs_t *fs, int inumber, const char *data, int length, int offset );
 
 #endif
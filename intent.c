@@ -0,0 +1,191 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "intent.h"
+#include "pool.h"
+#include "span.h"
+
+#define INTENT_MAGIC 0x1a7e0c01
+
+struct intent_header {
+	int magic;
+	int generation;
+};
+
+struct intent_record {
+	int magic;
+	int generation;
+	int inumber;
+	int offset;
+	int length;
+	uint32_t checksum; // of the fields above and the data
+};
+
+struct intent {
+	disk_t *disk;
+	int generation;
+	int head; // first free block
+};
+
+static int blocks_for( int length )
+{
+	return (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+}
+
+// FNV-1a over the record header, then its data. A record torn by a crash
+// while it was appended does not match.
+static uint32_t record_checksum( const struct intent_record *r, const char *data )
+{
+	struct intent_record fields = *r;
+	const unsigned char *p = (const unsigned char *)&fields;
+	uint32_t h = 2166136261u;
+	int i;
+
+	fields.checksum = 0;
+	for(i=0;i<sizeof(fields);i++) h = (h^p[i])*16777619u;
+	for(i=0;i<r->length;i++) h = (h^(unsigned char)data[i])*16777619u;
+	return h;
+}
+
+static int write_header( intent_t *l )
+{
+	char *block = pool_get();
+	struct intent_header *header = (struct intent_header *)block;
+
+	memset(block,0,DISK_BLOCK_SIZE);
+	header->magic = INTENT_MAGIC;
+	header->generation = l->generation;
+	disk_write(l->disk,0,block);
+	pool_put(block);
+	return disk_sync(l->disk);
+}
+
+// Visit the records of the current generation in order, stopping at the
+// first one that is stale or torn. Returns the block after the last one.
+static int walk( intent_t *l, intent_apply apply, void *arg, int *count )
+{
+	union { struct intent_record r; char data[DISK_BLOCK_SIZE]; } *header = pool_get();
+	int size = disk_size(l->disk), b = 1, i, n;
+	char *data;
+
+	while(b<size) {
+		disk_read(l->disk,b,header->data);
+		if(header->r.magic!=INTENT_MAGIC || header->r.generation!=l->generation) break;
+		if(header->r.length<=0) break;
+		n = blocks_for(header->r.length);
+		if(b+1+n>size) break;
+
+		data = malloc((size_t)n*DISK_BLOCK_SIZE);
+		if(!data) break;
+		for(i=0;i<n;i++) disk_read(l->disk,b+1+i,data+i*DISK_BLOCK_SIZE);
+		if(record_checksum(&header->r,data)!=header->r.checksum) {
+			free(data);
+			break;
+		}
+		if(apply) apply(arg,header->r.inumber,data,header->r.length,header->r.offset);
+		free(data);
+		if(count) (*count)++;
+		b += 1+n;
+	}
+	pool_put(header);
+	return b;
+}
+
+// A disk that holds no intent log yet is given an empty one
+intent_t *intent_open( disk_t *disk )
+{
+	intent_t *l = calloc(1,sizeof(intent_t));
+	char *block;
+
+	if(!l) return 0;
+	l->disk = disk;
+	if(disk_size(disk)<2) {
+		free(l);
+		return 0;
+	}
+
+	block = pool_get();
+	disk_read(disk,0,block);
+	if(((struct intent_header *)block)->magic==INTENT_MAGIC) {
+		l->generation = ((struct intent_header *)block)->generation;
+	} else {
+		l->generation = 1;
+		if(!write_header(l)) {
+			pool_put(block);
+			free(l);
+			return 0;
+		}
+	}
+	pool_put(block);
+
+	l->head = walk(l,0,0,0);
+	return l;
+}
+
+// Write one record after the last, in a single request. Returns 0 if it
+// does not fit; the caller syncs the disk.
+int intent_append( intent_t *l, int inumber, const char *data, int length, int offset )
+{
+	SPAN("intent_append",inumber);
+	int n = blocks_for(length);
+	char *buffer;
+
+	if(length<=0 || l->head+1+n>disk_size(l->disk)) return 0;
+	if(posix_memalign((void **)&buffer,DISK_BLOCK_SIZE,(size_t)(1+n)*DISK_BLOCK_SIZE)) return 0;
+
+	struct intent_record *r = (struct intent_record *)buffer;
+	memset(buffer,0,(size_t)(1+n)*DISK_BLOCK_SIZE);
+	r->magic = INTENT_MAGIC;
+	r->generation = l->generation;
+	r->inumber = inumber;
+	r->offset = offset;
+	r->length = length;
+	memcpy(buffer+DISK_BLOCK_SIZE,data,length);
+	r->checksum = record_checksum(r,buffer+DISK_BLOCK_SIZE);
+
+	disk_writev(l->disk,l->head,1+n,buffer);
+	l->head += 1+n;
+	free(buffer);
+	return 1;
+}
+
+// Hand every record that survived to apply, oldest first. Returns how many.
+int intent_replay( intent_t *l, intent_apply apply, void *arg )
+{
+	SPAN("intent_replay",-1);
+	int count = 0;
+
+	walk(l,apply,arg,&count);
+	return count;
+}
+
+// Called once the main image holds everything logged so far
+int intent_reset( intent_t *l )
+{
+	l->generation++;
+	l->head = 1;
+	return write_header(l);
+}
+
+int intent_used( intent_t *l )
+{
+	return l->head-1;
+}
+
+int intent_size( intent_t *l )
+{
+	return disk_size(l->disk)-1;
+}
+
+disk_t *intent_disk( intent_t *l )
+{
+	return l->disk;
+}
+
+void intent_close( intent_t *l )
+{
+	free(l);
+}
@@ -0,0 +1,26 @@
+#ifndef INTENT_H
+#define INTENT_H
+
+#include "disk.h"
+
+// An intent log on its own disk, ideally a small fast one. Synchronous
+// writes are appended to it and are durable once it is synced; the main
+// image catches up later. Block 0 holds the current generation, and
+// records follow from block 1 on: a header block, then the data.
+// Starting over only bumps the generation, which makes every record
+// already on the disk stale.
+
+typedef struct intent intent_t;
+
+typedef int (*intent_apply)( void *arg, int inumber, const char *data, int length, int offset );
+
+intent_t *intent_open( disk_t *disk );
+int  intent_append( intent_t *l, int inumber, const char *data, int length, int offset );
+int  intent_replay( intent_t *l, intent_apply apply, void *arg );
+int  intent_reset( intent_t *l );
+int  intent_used( intent_t *l );
+int  intent_size( intent_t *l );
+disk_t *intent_disk( intent_t *l );
+void intent_close( intent_t *l );
+
+#endif
@@ -0,0 +1,260 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "itable.h"
+#include "bitmap.h"
+
+typedef long long (*sum_func)( const int *, int );
+typedef int (*larger_func)( const int *, int, int, int *, int );
+
+int itable_init( struct itable *t, int ninodes )
+{
+	int i;
+
+	memset(t,0,sizeof(*t));
+	t->ninodes = ninodes;
+	t->valid = calloc(BITMAP_WORDS(ninodes),sizeof(uint64_t));
+	t->orphan = calloc(BITMAP_WORDS(ninodes),sizeof(uint64_t));
+	t->size = calloc(ninodes,sizeof(int));
+	t->indirect = calloc(ninodes,sizeof(int));
+	for(i=0;i<POINTERS_PER_INODE;i++) {
+		t->direct[i] = calloc(ninodes,sizeof(int));
+		if(!t->direct[i]) break;
+	}
+
+	if(!t->valid || !t->orphan || !t->size || !t->indirect || i<POINTERS_PER_INODE) {
+		itable_free(t);
+		return 0;
+	}
+	return 1;
+}
+
+void itable_free( struct itable *t )
+{
+	int i;
+
+	free(t->valid);
+	free(t->orphan);
+	free(t->size);
+	free(t->indirect);
+	for(i=0;i<POINTERS_PER_INODE;i++) free(t->direct[i]);
+	memset(t,0,sizeof(*t));
+}
+
+void itable_set( struct itable *t, int inumber, const struct fs_inode *inode )
+{
+	int i;
+
+	if(inumber<0 || inumber>=t->ninodes) return;
+
+	if(inode->isvalid==FS_INODE_ORPHAN) bitmap_set(t->orphan,inumber);
+	else bitmap_clear(t->orphan,inumber);
+
+	if(inode->isvalid && inode->isvalid!=FS_INODE_ORPHAN) {
+		bitmap_set(t->valid,inumber);
+		t->size[inumber] = inode->size;
+		for(i=0;i<POINTERS_PER_INODE;i++) t->direct[i][inumber] = inode->direct[i];
+		t->indirect[inumber] = inode->indirect;
+	} else {
+		bitmap_clear(t->valid,inumber);
+		t->size[inumber] = 0;
+		for(i=0;i<POINTERS_PER_INODE;i++) t->direct[i][inumber] = 0;
+		t->indirect[inumber] = 0;
+	}
+}
+
+void itable_get( struct itable *t, int inumber, struct fs_inode *inode )
+{
+	int i;
+
+	inode->isvalid = bitmap_test(t->valid,inumber);
+	inode->size = t->size[inumber];
+	for(i=0;i<POINTERS_PER_INODE;i++) inode->direct[i] = t->direct[i][inumber];
+	inode->indirect = t->indirect[inumber];
+}
+
+int itable_valid( struct itable *t, int inumber )
+{
+	if(inumber<0 || inumber>=t->ninodes) return 0;
+	return bitmap_test(t->valid,inumber);
+}
+
+int itable_orphan( struct itable *t, int inumber )
+{
+	if(inumber<0 || inumber>=t->ninodes) return 0;
+	return bitmap_test(t->orphan,inumber);
+}
+
+// Returns the first free inumber at or after start, or 0 if none is left
+int itable_find_free( struct itable *t, int start )
+{
+	int w, nwords = BITMAP_WORDS(t->ninodes);
+
+	if(start<0) start = 0;
+	if(start>=t->ninodes) return 0;
+
+	w = start/64;
+	uint64_t bits = ~t->valid[w] & (~(uint64_t)0 << (start%64));
+	while(1) {
+		if(bits) {
+			int inumber = w*64 + __builtin_ctzll(bits);
+			return inumber<t->ninodes ? inumber : 0;
+		}
+		if(++w>=nwords) return 0;
+		bits = ~t->valid[w];
+	}
+}
+
+// Inode 0 is never handed out, so it is not counted even if its bit is set
+int itable_count_valid( struct itable *t )
+{
+	int w, count=0;
+
+	for(w=0;w<BITMAP_WORDS(t->ninodes);w++) count += __builtin_popcountll(w==0 ? t->valid[w]&~(uint64_t)1 : t->valid[w]);
+	return count;
+}
+
+int itable_count_orphans( struct itable *t )
+{
+	int w, count=0;
+
+	for(w=0;w<BITMAP_WORDS(t->ninodes);w++) count += __builtin_popcountll(w==0 ? t->orphan[w]&~(uint64_t)1 : t->orphan[w]);
+	return count;
+}
+
+// Size kernels. Sizes are widened to 64 bits before they are added so a
+// table of large files cannot overflow the sum.
+
+static long long sum_scalar( const int *size, int n )
+{
+	long long total=0;
+	int i;
+
+	for(i=0;i<n;i++) total += size[i];
+	return total;
+}
+
+__attribute__((target("avx2")))
+static long long sum_avx2( const int *size, int n )
+{
+	__m256i acc = _mm256_setzero_si256();
+	long long lanes[4];
+	int i;
+
+	for(i=0;i+4<=n;i+=4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(size+i));
+		acc = _mm256_add_epi64(acc,_mm256_cvtepi32_epi64(v));
+	}
+	_mm256_storeu_si256((__m256i *)lanes,acc);
+	return lanes[0]+lanes[1]+lanes[2]+lanes[3] + sum_scalar(size+i,n-i);
+}
+
+__attribute__((target("avx512f")))
+static long long sum_avx512( const int *size, int n )
+{
+	__m512i acc = _mm512_setzero_si512();
+	int i;
+
+	for(i=0;i+8<=n;i+=8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(size+i));
+		acc = _mm512_add_epi64(acc,_mm512_cvtepi32_epi64(v));
+	}
+	return _mm512_reduce_add_epi64(acc) + sum_scalar(size+i,n-i);
+}
+
+static int larger_scalar( const int *size, int n, int threshold, int *out, int max )
+{
+	int i, found=0;
+
+	for(i=0;i<n && found<max;i++) {
+		if(size[i]>threshold) out[found++] = i;
+	}
+	return found;
+}
+
+__attribute__((target("avx2")))
+static int larger_avx2( const int *size, int n, int threshold, int *out, int max )
+{
+	const __m256i limit = _mm256_set1_epi32(threshold);
+	int i, found=0;
+
+	for(i=0;i+8<=n && found<max;i+=8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(size+i));
+		unsigned hits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v,limit)));
+		while(hits && found<max) {
+			out[found++] = i + __builtin_ctz(hits);
+			hits &= hits-1;
+		}
+	}
+	if(found<max) {
+		int k, more = larger_scalar(size+i,n-i,threshold,out+found,max-found);
+		for(k=0;k<more;k++) out[found+k] += i;
+		found += more;
+	}
+	return found;
+}
+
+__attribute__((target("avx512f")))
+static int larger_avx512( const int *size, int n, int threshold, int *out, int max )
+{
+	const __m512i limit = _mm512_set1_epi32(threshold);
+	int i, found=0;
+
+	for(i=0;i+16<=n && found<max;i+=16) {
+		__m512i v = _mm512_loadu_si512((const void *)(size+i));
+		unsigned hits = _mm512_cmpgt_epi32_mask(v,limit);
+		while(hits && found<max) {
+			out[found++] = i + __builtin_ctz(hits);
+			hits &= hits-1;
+		}
+	}
+	if(found<max) {
+		int k, more = larger_scalar(size+i,n-i,threshold,out+found,max-found);
+		for(k=0;k<more;k++) out[found+k] += i;
+		found += more;
+	}
+	return found;
+}
+
+long long itable_used_bytes( struct itable *t )
+{
+	static sum_func kernel = 0;
+
+	if(!kernel) {
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")) kernel = sum_avx512;
+		else if(__builtin_cpu_supports("avx2")) kernel = sum_avx2;
+		else kernel = sum_scalar;
+	}
+	return kernel(t->size,t->ninodes);
+}
+
+// Fills inumbers with up to max valid inodes of at least minsize bytes
+int itable_find_at_least( struct itable *t, int minsize, int *inumbers, int max )
+{
+	static larger_func kernel = 0;
+	int i, found=0;
+
+	if(!kernel) {
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f")) kernel = larger_avx512;
+		else if(__builtin_cpu_supports("avx2")) kernel = larger_avx2;
+		else kernel = larger_scalar;
+	}
+
+	if(max<=0 || t->ninodes<=1) return 0;
+
+	// Invalid inodes have size 0, so only a minimum of 0 or less, which
+	// takes in empty files, needs the valid bits. Inode 0 is skipped.
+	if(minsize<=0) {
+		for(i=1;i<t->ninodes && found<max;i++) {
+			if(itable_valid(t,i)) inumbers[found++] = i;
+		}
+		return found;
+	}
+	found = kernel(t->size+1,t->ninodes-1,minsize-1,inumbers,max);
+	for(i=0;i<found;i++) inumbers[i]++;
+	return found;
+}
@@ -0,0 +1,36 @@
+#ifndef ITABLE_H
+#define ITABLE_H
+
+#include <stdint.h>
+
+#include "layout.h"
+
+// In-memory copy of the inode table kept column by column, so whole-table
+// queries stream through one dense array instead of striding over
+// struct fs_inode. Invalid inodes are stored with size 0 and no pointers.
+// Orphans are invalid too, but are flagged until their blocks are freed.
+
+struct itable {
+	int ninodes;
+	uint64_t *valid;
+	uint64_t *orphan;
+	int *size;
+	int *direct[POINTERS_PER_INODE];
+	int *indirect;
+};
+
+int  itable_init( struct itable *t, int ninodes );
+void itable_free( struct itable *t );
+
+void itable_set( struct itable *t, int inumber, const struct fs_inode *inode );
+void itable_get( struct itable *t, int inumber, struct fs_inode *inode );
+int  itable_valid( struct itable *t, int inumber );
+int  itable_orphan( struct itable *t, int inumber );
+
+int       itable_find_free( struct itable *t, int start );
+int       itable_count_valid( struct itable *t );
+int       itable_count_orphans( struct itable *t );
+long long itable_used_bytes( struct itable *t );
+int       itable_find_at_least( struct itable *t, int minsize, int *inumbers, int max );
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "disk.h"
+
+// On-disk layout shared by fs.c and the modules that work on its structures
+
+// Constants
+
+#define FS_MAGIC           0xf0f03410
+#define INODES_PER_BLOCK   128
+#define POINTERS_PER_INODE 5
+#define POINTERS_PER_BLOCK 1024
+
+// Superblock feature flags
+
+#define FS_FEATURE_LAZY_ITABLE 0x1 // inode blocks at or past inode_watermark read as empty
+#define FS_FEATURE_LOG         0x2 // log-structured: everything is appended to segments
+
+// Log-structured layout: the superblock, imap_blocks blocks of inode map,
+// then segments of SEGMENT_BLOCKS blocks. The first block of each segment
+// is its summary, naming the owner of every other block in it.
+
+#define SEGMENT_BLOCKS     32
+#define SUMMARY_FREE       -3 // slot not written
+#define SUMMARY_INODES     -2 // a block of the inode table, inumber is its index
+#define SUMMARY_INDIRECT   -1 // an inode's indirect block
+
+// Data Structures
+
+struct fs_superblock {
+	int magic;
+	int nblocks;
+	int ninodeblocks;
+	int ninodes;
+	int features;
+	int inode_watermark;
+	int imap_blocks;
+	int log_seq;
+};
+
+// Values of fs_inode.isvalid. An orphan has been deleted but still owns
+// its blocks until they are freed in the background.
+#define FS_INODE_FREE   0
+#define FS_INODE_VALID  1
+#define FS_INODE_ORPHAN 2
+
+struct fs_inode {
+	int isvalid;
+	int size;
+	int direct[POINTERS_PER_INODE];
+	int indirect;
+};
+
+struct fs_summary_entry {
+	int inumber;
+	int lblock; // logical block within the file, or one of SUMMARY_*
+};
+
+struct fs_summary {
+	int seq;
+	struct fs_summary_entry entry[SEGMENT_BLOCKS];
+};
+
+union fs_block {
+	struct fs_superblock super;
+	struct fs_inode inode[INODES_PER_BLOCK];
+	struct fs_summary summary;
+	int pointers[POINTERS_PER_BLOCK];
+	char data[DISK_BLOCK_SIZE];
+};
+
+#endif
@@ -0,0 +1,659 @@
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+// Miss ratio curves from cache traces (see cache_trace), for choosing the
+// data and metadata budgets to give cache_init for each image.
+//
+// The LRU curve comes from reuse distances: a block hits in an LRU cache
+// of n blocks if fewer than n other blocks were accessed since its last
+// access. Distances are counted with a Fenwick tree over access times in
+// which only the latest access to each block is marked.
+//
+// ARC, which the cache runs, has no such stack property, so its curve
+// comes from simulation instead: one small ARC for each cache size on a
+// grid, all fed the same accesses.
+//
+// Both follow SHARDS to stay fast on long traces: only blocks whose hash
+// falls under the sampling rate are followed, reuse distances are scaled
+// up by 1/rate, and each simulated ARC is rate times smaller than the
+// cache it stands for. Sampling by block, not by access, keeps every
+// access to a followed block. The difference between the accesses sampled
+// and rate times those seen is counted as hits at distance 0 (SHARDS-adj),
+// which corrects for a few hot blocks falling in or out of the sample.
+//
+// Writes bring blocks in and make them recent, as they do in the cache,
+// but only reads count as hits or misses, since no write waits for the
+// disk. Each kind of block has its own curves, as it has its own
+// partition. Everything comes out of one pass over each trace.
+
+#define HASH_RANGE (1<<24)
+#define GRID_MIN   16   // smallest cache size on the grid, in blocks
+#define GRID_STEPS 48   // each step is sqrt(2) larger
+#define CHUNK      65536
+
+static const char *kind_names[2] = {"data","metadata"};
+
+// Last access time of each followed block, by open addressing
+struct blockmap {
+	int *keys;  // -1 for an empty slot
+	int *times;
+	int mask;
+	int count;
+};
+
+struct arc_entry {
+	int blocknum;
+	int list;  // -1 while free
+	int prev;
+	int next;
+	int hnext;
+};
+
+// An ARC without data, as in cache.c. Entries are added as they are
+// needed, so a large cache over few blocks stays small.
+struct arc {
+	int size;     // the cache size it stands for
+	int capacity; // size scaled down by the sampling rate
+	int target;
+	struct arc_entry *entries;
+	int nentries;
+	int *hash;
+	int hash_mask;
+	int free_entries;
+	struct { int head, tail, size; } lists[4];
+	long long hits;
+	long long misses;
+};
+
+#define T1 CACHE_RECENT
+#define T2 CACHE_FREQUENT
+#define B1 CACHE_GHOST_RECENT
+#define B2 CACHE_GHOST_FREQUENT
+
+// Everything followed for one kind of block
+struct stream {
+	long long reads;     // all of them, sampled or not
+	long long writes;
+	long long sampled;   // reads of followed blocks
+	long long cold;      // of those, reads of blocks not seen before
+	struct blockmap map;
+	int *tree;           // Fenwick tree over times 1..tree_size
+	int tree_size;
+	int now;
+	long long *hist;     // sampled reads by reuse distance
+	int hist_size;
+	int max_distance;
+	struct arc arcs[GRID_STEPS];
+	int narcs;
+};
+
+static double rate = 0.01;
+static unsigned threshold;
+
+static uint64_t mix( uint64_t x )
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+	x = (x^(x>>27))*0x94d049bb133111ebULL;
+	return x^(x>>31);
+}
+
+static void out_of_memory()
+{
+	printf("out of memory\n");
+	exit(1);
+}
+
+static void *xcalloc( size_t n, size_t size )
+{
+	void *p = calloc(n,size);
+	if(!p) out_of_memory();
+	return p;
+}
+
+// Block map
+
+static void map_init( struct blockmap *m, int nslots )
+{
+	m->keys = malloc(nslots*sizeof(int));
+	m->times = xcalloc(nslots,sizeof(int));
+	if(!m->keys) out_of_memory();
+	memset(m->keys,0xff,nslots*sizeof(int));
+	m->mask = nslots-1;
+	m->count = 0;
+}
+
+static int map_slot( struct blockmap *m, int blocknum )
+{
+	int i = (mix(blocknum)>>32) & m->mask;
+	while(m->keys[i]>=0 && m->keys[i]!=blocknum) i = (i+1) & m->mask;
+	return i;
+}
+
+static void map_grow( struct blockmap *m )
+{
+	struct blockmap old = *m;
+	int i, slot;
+
+	map_init(m,2*(old.mask+1));
+	for(i=0;i<=old.mask;i++) {
+		if(old.keys[i]<0) continue;
+		slot = map_slot(m,old.keys[i]);
+		m->keys[slot] = old.keys[i];
+		m->times[slot] = old.times[i];
+		m->count++;
+	}
+	free(old.keys);
+	free(old.times);
+}
+
+// Fenwick tree
+
+static void tree_add( struct stream *s, int i, int v )
+{
+	for(;i<=s->tree_size;i+=i&-i) s->tree[i] += v;
+}
+
+static int tree_sum( struct stream *s, int i )
+{
+	int sum = 0;
+	for(;i>0;i-=i&-i) sum += s->tree[i];
+	return sum;
+}
+
+struct stamp {
+	int time;
+	int slot;
+};
+
+static int stamp_compare( const void *a, const void *b )
+{
+	return ((const struct stamp *)a)->time - ((const struct stamp *)b)->time;
+}
+
+// Out of times: number the latest accesses 1..n again, keeping their order
+static void renumber( struct stream *s )
+{
+	struct stamp *stamps = xcalloc(s->map.count+1,sizeof(struct stamp));
+	int i, n = 0;
+
+	for(i=0;i<=s->map.mask;i++) {
+		if(s->map.keys[i]<0) continue;
+		stamps[n].time = s->map.times[i];
+		stamps[n].slot = i;
+		n++;
+	}
+	qsort(stamps,n,sizeof(struct stamp),stamp_compare);
+
+	free(s->tree);
+	s->tree_size = 2*n+CHUNK;
+	s->tree = xcalloc(s->tree_size+1,sizeof(int));
+	for(i=0;i<n;i++) {
+		s->map.times[stamps[i].slot] = i+1;
+		tree_add(s,i+1,1);
+	}
+	s->now = n;
+	free(stamps);
+}
+
+// Simulated ARC
+
+static void arc_list_remove( struct arc *a, int e )
+{
+	struct arc_entry *entries = a->entries;
+	int l = entries[e].list;
+	if(entries[e].prev>=0) entries[entries[e].prev].next = entries[e].next;
+	else a->lists[l].head = entries[e].next;
+	if(entries[e].next>=0) entries[entries[e].next].prev = entries[e].prev;
+	else a->lists[l].tail = entries[e].prev;
+	a->lists[l].size--;
+}
+
+static void arc_list_push( struct arc *a, int l, int e )
+{
+	struct arc_entry *entries = a->entries;
+	entries[e].list = l;
+	entries[e].prev = -1;
+	entries[e].next = a->lists[l].head;
+	if(a->lists[l].head>=0) entries[a->lists[l].head].prev = e;
+	else a->lists[l].tail = e;
+	a->lists[l].head = e;
+	a->lists[l].size++;
+}
+
+static void arc_list_move( struct arc *a, int e, int l )
+{
+	arc_list_remove(a,e);
+	arc_list_push(a,l,e);
+}
+
+static int arc_slot( struct arc *a, int blocknum )
+{
+	return (blocknum*2654435761u) & a->hash_mask;
+}
+
+static int arc_find( struct arc *a, int blocknum )
+{
+	int e;
+	if(!a->hash) return -1;
+	for(e=a->hash[arc_slot(a,blocknum)];e>=0;e=a->entries[e].hnext) {
+		if(a->entries[e].blocknum==blocknum) return e;
+	}
+	return -1;
+}
+
+// Double the entries, up to the two per block of capacity ARC can use,
+// and rehash everything in use
+static void arc_grow( struct arc *a )
+{
+	int n = a->nentries ? 2*a->nentries : 64, nhash, i, slot;
+
+	if(n>2*a->capacity) n = 2*a->capacity;
+	a->entries = realloc(a->entries,n*sizeof(struct arc_entry));
+	if(!a->entries) out_of_memory();
+	for(i=a->nentries;i<n;i++) {
+		a->entries[i].list = -1;
+		a->entries[i].next = i+1<n ? i+1 : -1;
+	}
+	a->free_entries = a->nentries;
+	a->nentries = n;
+
+	for(nhash=1;nhash<2*n;nhash*=2) {}
+	free(a->hash);
+	a->hash = malloc(nhash*sizeof(int));
+	if(!a->hash) out_of_memory();
+	a->hash_mask = nhash-1;
+	for(i=0;i<nhash;i++) a->hash[i] = -1;
+	for(i=0;i<n;i++) {
+		if(a->entries[i].list<0) continue;
+		slot = arc_slot(a,a->entries[i].blocknum);
+		a->entries[i].hnext = a->hash[slot];
+		a->hash[slot] = i;
+	}
+}
+
+static int arc_alloc( struct arc *a, int blocknum, int l )
+{
+	int e, slot;
+
+	if(a->free_entries<0) arc_grow(a);
+	e = a->free_entries;
+	a->free_entries = a->entries[e].next;
+
+	slot = arc_slot(a,blocknum);
+	a->entries[e].blocknum = blocknum;
+	a->entries[e].hnext = a->hash[slot];
+	a->hash[slot] = e;
+	arc_list_push(a,l,e);
+	return e;
+}
+
+static void arc_drop( struct arc *a, int e )
+{
+	int *h = &a->hash[arc_slot(a,a->entries[e].blocknum)];
+	while(*h!=e) h = &a->entries[*h].hnext;
+	*h = a->entries[e].hnext;
+
+	arc_list_remove(a,e);
+	a->entries[e].list = -1;
+	a->entries[e].next = a->free_entries;
+	a->free_entries = e;
+}
+
+static int arc_resident( struct arc *a )
+{
+	return a->lists[T1].size + a->lists[T2].size;
+}
+
+static void arc_replace( struct arc *a, int ghost_list )
+{
+	int t1 = a->lists[T1].size;
+	if(a->lists[T2].size==0 || (t1>0 && (t1>a->target || (ghost_list==B2 && t1==a->target)))) {
+		arc_list_move(a,a->lists[T1].tail,B1);
+	} else {
+		arc_list_move(a,a->lists[T2].tail,B2);
+	}
+}
+
+static void arc_make_room( struct arc *a )
+{
+	int total = arc_resident(a) + a->lists[B1].size + a->lists[B2].size;
+
+	if(a->lists[T1].size+a->lists[B1].size>=a->capacity) {
+		if(a->lists[B1].size>0) {
+			arc_drop(a,a->lists[B1].tail);
+			if(arc_resident(a)>=a->capacity) arc_replace(a,-1);
+		} else {
+			arc_drop(a,a->lists[T1].tail);
+		}
+	} else if(total>=a->capacity) {
+		if(total>=2*a->capacity) arc_drop(a,a->lists[B2].size ? a->lists[B2].tail : a->lists[B1].tail);
+		if(arc_resident(a)>=a->capacity) arc_replace(a,-1);
+	}
+}
+
+static void arc_access( struct arc *a, int blocknum, int read )
+{
+	int e = arc_find(a,blocknum), l;
+
+	if(e>=0 && (a->entries[e].list==T1 || a->entries[e].list==T2)) {
+		if(read) a->hits++;
+		arc_list_move(a,e,T2);
+		return;
+	}
+
+	if(read) a->misses++;
+	if(e>=0) {
+		int b1 = a->lists[B1].size, b2 = a->lists[B2].size;
+		l = a->entries[e].list;
+		if(l==B1) {
+			a->target += b2>b1 ? b2/b1 : 1;
+			if(a->target>a->capacity) a->target = a->capacity;
+		} else {
+			a->target -= b1>b2 ? b1/b2 : 1;
+			if(a->target<0) a->target = 0;
+		}
+		if(arc_resident(a)>=a->capacity) arc_replace(a,l);
+		arc_list_move(a,e,T2);
+	} else {
+		arc_make_room(a);
+		arc_alloc(a,blocknum,T1);
+	}
+}
+
+static void arc_init( struct arc *a, int size )
+{
+	int i;
+
+	memset(a,0,sizeof(*a));
+	a->size = size;
+	a->capacity = size*rate+0.5;
+	a->free_entries = -1;
+	for(i=0;i<4;i++) a->lists[i].head = a->lists[i].tail = -1;
+}
+
+// Streams
+
+static void stream_init( struct stream *s, int nblocks )
+{
+	double size = GRID_MIN;
+
+	memset(s,0,sizeof(*s));
+	map_init(&s->map,1024);
+	s->tree_size = CHUNK;
+	s->tree = xcalloc(s->tree_size+1,sizeof(int));
+	s->hist_size = 1024;
+	s->hist = xcalloc(s->hist_size,sizeof(long long));
+	s->max_distance = -1;
+
+	// The grid ends at the first size that holds the whole disk
+	while(s->narcs<GRID_STEPS) {
+		arc_init(&s->arcs[s->narcs++],(int)size);
+		if(size>=nblocks) break;
+		size *= M_SQRT2;
+	}
+}
+
+static void stream_free( struct stream *s )
+{
+	int i;
+
+	free(s->map.keys);
+	free(s->map.times);
+	free(s->tree);
+	free(s->hist);
+	for(i=0;i<s->narcs;i++) {
+		free(s->arcs[i].entries);
+		free(s->arcs[i].hash);
+	}
+}
+
+static void stream_access( struct stream *s, int blocknum, int write )
+{
+	int slot, distance, i;
+
+	if(write) s->writes++;
+	else s->reads++;
+	if((mix(blocknum) & (HASH_RANGE-1))>=threshold) return;
+	if(!write) s->sampled++;
+
+	for(i=0;i<s->narcs;i++) {
+		if(s->arcs[i].capacity>0) arc_access(&s->arcs[i],blocknum,!write);
+	}
+
+	if(s->now==s->tree_size) renumber(s);
+	s->now++;
+
+	slot = map_slot(&s->map,blocknum);
+	if(s->map.keys[slot]<0) {
+		if(!write) s->cold++;
+		if(2*(s->map.count+1)>s->map.mask+1) {
+			map_grow(&s->map);
+			slot = map_slot(&s->map,blocknum);
+		}
+		s->map.keys[slot] = blocknum;
+		s->map.count++;
+	} else {
+		int last = s->map.times[slot];
+		distance = tree_sum(s,s->now-1)-tree_sum(s,last);
+		tree_add(s,last,-1);
+		if(distance>=s->hist_size) {
+			int n = s->hist_size;
+			while(n<=distance) n *= 2;
+			s->hist = realloc(s->hist,n*sizeof(long long));
+			if(!s->hist) out_of_memory();
+			memset(s->hist+s->hist_size,0,(n-s->hist_size)*sizeof(long long));
+			s->hist_size = n;
+		}
+		if(!write) {
+			s->hist[distance]++;
+			if(distance>s->max_distance) s->max_distance = distance;
+		}
+	}
+	s->map.times[slot] = s->now;
+	tree_add(s,s->now,1);
+}
+
+// After the pass: the number of reads the sample stands for, with the
+// difference from what was sampled credited as hits at distance 0
+static double expected( struct stream *s )
+{
+	return s->reads*rate;
+}
+
+static double adjustment( struct stream *s )
+{
+	double a = expected(s)-s->sampled;
+	if(a<-(double)s->hist[0]) a = -(double)s->hist[0];
+	return a;
+}
+
+// Miss ratio of an LRU cache of size blocks
+static double lru_miss_ratio( struct stream *s, long long size )
+{
+	double total = s->sampled+adjustment(s), hits = adjustment(s);
+	long long cut = ceil(size*rate), d;
+
+	if(total<=0) return 0;
+	for(d=0;d<cut && d<=s->max_distance;d++) hits += s->hist[d];
+	return 1-hits/total;
+}
+
+static double arc_miss_ratio( struct arc *a )
+{
+	long long n = a->hits+a->misses;
+	return n ? (double)a->misses/n : 0;
+}
+
+// Smallest LRU cache with at least target of reads hitting, or -1
+static long long lru_size_for( struct stream *s, double target )
+{
+	double total = s->sampled+adjustment(s), hits = adjustment(s);
+	long long d;
+
+	if(total<=0) return 0;
+	if(hits>=target*total) return 1;
+	for(d=0;d<=s->max_distance;d++) {
+		hits += s->hist[d];
+		if(hits>=target*total) return ceil((d+1)/rate);
+	}
+	return -1;
+}
+
+static long long arc_size_for( struct stream *s, double target )
+{
+	int i;
+
+	if(s->sampled==0) return 0;
+	for(i=0;i<s->narcs;i++) {
+		struct arc *a = &s->arcs[i];
+		if(a->capacity>0 && 1-arc_miss_ratio(a)>=target) return a->size;
+	}
+	return -1;
+}
+
+static void print_size( long long blocks, int block_size )
+{
+	if(blocks<0) {
+		printf("%10s %10s","-","-");
+	} else {
+		printf("%10lld %10.1f",blocks,blocks*(double)block_size/(1024*1024));
+	}
+}
+
+// One pass over a trace. Returns 0 if it could not be read.
+static int analyze( const char *filename, double target, int quiet, long long *recommended, long long *total )
+{
+	struct cache_trace_header header;
+	struct cache_trace_record *records;
+	struct stream streams[2];
+	FILE *file = fopen(filename,"r");
+	size_t n, i;
+	int kind;
+
+	if(!file) {
+		printf("couldn't open %s\n",filename);
+		return 0;
+	}
+	if(fread(&header,sizeof(header),1,file)!=1 || header.magic!=CACHE_TRACE_MAGIC || header.nblocks<=0) {
+		printf("%s is not a cache trace\n",filename);
+		fclose(file);
+		return 0;
+	}
+
+	records = xcalloc(CHUNK,sizeof(struct cache_trace_record));
+	for(kind=0;kind<2;kind++) stream_init(&streams[kind],header.nblocks);
+	while((n = fread(records,sizeof(struct cache_trace_record),CHUNK,file))>0) {
+		for(i=0;i<n;i++) {
+			if(records[i].kind>CACHE_META) continue;
+			stream_access(&streams[records[i].kind],records[i].blocknum,records[i].write);
+		}
+	}
+	fclose(file);
+	free(records);
+
+	*total = streams[CACHE_DATA].reads+streams[CACHE_META].reads;
+	for(kind=0;kind<2;kind++) {
+		recommended[2*kind] = lru_size_for(&streams[kind],target);
+		recommended[2*kind+1] = arc_size_for(&streams[kind],target);
+	}
+
+	if(!quiet) {
+		printf("%s: a disk of %d blocks, %lld reads sampled\n",filename,header.nblocks,streams[CACHE_DATA].sampled+streams[CACHE_META].sampled);
+		for(kind=0;kind<2;kind++) {
+			printf("    %-8s %12lld reads %12lld writes\n",kind_names[kind],streams[kind].reads,streams[kind].writes);
+		}
+		printf("\n%10s %10s %17s %17s\n","","","data miss ratio","meta miss ratio");
+		printf("%10s %10s %8s %8s %8s %8s\n","blocks","MB","LRU","ARC","LRU","ARC");
+
+		// Stop once neither curve can fall any further
+		for(i=0;i<streams[0].narcs;i++) {
+			long long size = streams[0].arcs[i].size;
+			printf("%10lld %10.1f",size,size*(double)header.block_size/(1024*1024));
+			for(kind=0;kind<2;kind++) {
+				struct arc *a = &streams[kind].arcs[i];
+				printf(" %8.4f",lru_miss_ratio(&streams[kind],size));
+				if(a->capacity>0) printf(" %8.4f",arc_miss_ratio(a));
+				else printf(" %8s","-");
+			}
+			printf("\n");
+			if(size*rate>streams[0].max_distance+1 && size*rate>streams[1].max_distance+1) break;
+		}
+
+		printf("\nfor %.1f%% of reads to hit:\n",target*100);
+		printf("%-10s %10s %10s %10s %10s\n","","LRU blocks","MB","ARC blocks","MB");
+		for(kind=0;kind<2;kind++) {
+			printf("%-10s ",kind_names[kind]);
+			print_size(recommended[2*kind],header.block_size);
+			printf(" ");
+			print_size(recommended[2*kind+1],header.block_size);
+			printf("\n");
+		}
+		printf("(- where first reads alone miss more than that)\n\n");
+	}
+
+	for(kind=0;kind<2;kind++) stream_free(&streams[kind]);
+	return 1;
+}
+
+static void usage( const char *name )
+{
+	printf("use: %s [options] <trace> ...\n",name);
+	printf("    -r <rate>          fraction of blocks sampled, 1 for exact curves (0.01)\n");
+	printf("    -t <hit ratio>     target hit ratio to size the cache for (0.9)\n");
+	printf("    -q                 only the summary line for each trace\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	double target = 0.9;
+	int quiet = 0, c, i, failed = 0;
+	long long (*recommended)[4], *totals;
+	char *ok;
+
+	while((c = getopt(argc,argv,"r:t:q"))!=-1) {
+		switch(c) {
+			case 'r': rate = atof(optarg); break;
+			case 't': target = atof(optarg); break;
+			case 'q': quiet = 1; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(optind==argc || rate<=0 || rate>1 || target<=0 || target>1) {
+		usage(argv[0]);
+		return 1;
+	}
+	threshold = rate*HASH_RANGE;
+	if(threshold==0) threshold = 1;
+	rate = (double)threshold/HASH_RANGE;
+
+	recommended = xcalloc(argc-optind,sizeof(*recommended));
+	totals = xcalloc(argc-optind,sizeof(long long));
+	ok = xcalloc(argc-optind,1);
+	for(i=optind;i<argc;i++) {
+		ok[i-optind] = analyze(argv[i],target,quiet,recommended[i-optind],&totals[i-optind]);
+		if(!ok[i-optind]) failed = 1;
+	}
+
+	// One line per image, with the sizes to pass to cache_init
+	printf("cache sizes in blocks for %.1f%% hits, sampled at %.4g:\n",target*100,rate);
+	printf("%-24s %12s %10s %10s %10s %10s\n","trace","reads","data LRU","data ARC","meta LRU","meta ARC");
+	for(i=optind;i<argc;i++) {
+		long long *r = recommended[i-optind];
+		if(!ok[i-optind]) continue;
+		printf("%-24s %12lld",argv[i],totals[i-optind]);
+		for(c=0;c<4;c++) {
+			if(r[c]<0) printf(" %10s","-");
+			else printf(" %10lld",r[c]);
+		}
+		printf("\n");
+	}
+	return failed;
+}
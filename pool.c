@@ -0,0 +1,149 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+// Buffers are carved out of 2 MB slabs so that each slab can sit on one
+// huge page. Free buffers are kept on intrusive lists: the first word of
+// a free buffer points at the next one.
+
+#define SLAB_SIZE      (2 * 1024 * 1024)
+#define SLAB_BUFFERS   (SLAB_SIZE / DISK_BLOCK_SIZE)
+#define THREAD_MAX     64
+#define THREAD_REFILL  32
+
+struct pool_free {
+	struct pool_free *next;
+};
+
+struct pool_cache {
+	struct pool_free *head;
+	int count;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_free *global_head = 0;
+static int nslabs = 0;
+static int noutstanding = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static __thread struct pool_cache cache;
+
+static void *slab_alloc()
+{
+	void *slab;
+
+	// Prefer an explicit huge page, then a transparent one
+	slab = mmap(0,SLAB_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+	if(slab!=MAP_FAILED) return slab;
+
+	if(posix_memalign(&slab,SLAB_SIZE,SLAB_SIZE)) return 0;
+	madvise(slab,SLAB_SIZE,MADV_HUGEPAGE);
+	return slab;
+}
+
+// Called with pool_lock held
+static int slab_grow()
+{
+	char *slab = slab_alloc();
+	int i;
+
+	if(!slab) return 0;
+
+	for(i=SLAB_BUFFERS-1;i>=0;i--) {
+		struct pool_free *f = (struct pool_free *)(slab + i*DISK_BLOCK_SIZE);
+		f->next = global_head;
+		global_head = f;
+	}
+	nslabs++;
+	return 1;
+}
+
+// Hand every buffer in the calling thread's cache back to the global list
+static void cache_drain( int keep )
+{
+	pthread_mutex_lock(&pool_lock);
+	while(cache.count>keep) {
+		struct pool_free *f = cache.head;
+		cache.head = f->next;
+		cache.count--;
+		f->next = global_head;
+		global_head = f;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void thread_exit( void *unused )
+{
+	cache_drain(0);
+}
+
+static void key_create()
+{
+	pthread_key_create(&key,thread_exit);
+}
+
+// Make sure the thread's cache is drained when the thread exits
+static void cache_register()
+{
+	pthread_once(&key_once,key_create);
+	pthread_setspecific(key,&cache);
+}
+
+void *pool_get()
+{
+	struct pool_free *f;
+
+	if(!cache.head) {
+		cache_register();
+
+		pthread_mutex_lock(&pool_lock);
+		while(cache.count<THREAD_REFILL) {
+			if(!global_head && !slab_grow()) break;
+			f = global_head;
+			global_head = f->next;
+			f->next = cache.head;
+			cache.head = f;
+			cache.count++;
+		}
+		pthread_mutex_unlock(&pool_lock);
+
+		if(!cache.head) {
+			printf("ERROR: out of memory for block buffers!\n");
+			abort();
+		}
+	}
+
+	f = cache.head;
+	cache.head = f->next;
+	cache.count--;
+	__atomic_add_fetch(&noutstanding,1,__ATOMIC_RELAXED);
+	return f;
+}
+
+void pool_put( void *buffer )
+{
+	struct pool_free *f = buffer;
+
+	if(!f) return;
+	if(!cache.count) cache_register();
+
+	f->next = cache.head;
+	cache.head = f;
+	cache.count++;
+	__atomic_sub_fetch(&noutstanding,1,__ATOMIC_RELAXED);
+
+	if(cache.count>THREAD_MAX) cache_drain(THREAD_MAX/2);
+}
+
+void pool_stats( int *slabs, int *outstanding )
+{
+	pthread_mutex_lock(&pool_lock);
+	*slabs = nslabs;
+	pthread_mutex_unlock(&pool_lock);
+	*outstanding = __atomic_load_n(&noutstanding,__ATOMIC_RELAXED);
+}
@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "disk.h"
+
+// Every buffer handed out by the pool is DISK_BLOCK_SIZE bytes long and
+// DISK_BLOCK_SIZE aligned, so it can be passed straight to O_DIRECT I/O.
+
+void *pool_get();
+void  pool_put( void *buffer );
+void  pool_stats( int *slabs, int *outstanding );
+
+// Scoped handle: a buffer declared with POOL_SCOPED goes back to the pool
+// when the variable leaves scope, on every return path.
+//
+//	union fs_block *block POOL_SCOPED = pool_get();
+
+static inline void pool_put_scoped( void *handle )
+{
+	pool_put(*(void **)handle);
+}
+
+#define POOL_SCOPED __attribute__((cleanup(pool_put_scoped)))
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+// Static tracepoints for perf, bpftrace and SystemTap, in the format of
+// <sys/sdt.h> (USDT), without needing that header or anything at run time.
+// Each probe is a single nop in the code, and a note in the ELF file that
+// tells a tracer where it is and where to find its arguments:
+//
+//	PROBE3(fs_write_entry, inumber, offset, length);
+//
+//	bpftrace -e 'usdt:./simplefs:simplefs:fs_write_entry { @[arg0] = sum(arg2); }'
+//	perf probe -x ./simplefs sdt_simplefs:fs_write_entry
+//
+// Every probe belongs to the simplefs provider, and every argument is
+// passed as a signed 64-bit integer. Arguments are evaluated whether or
+// not anything is tracing, so they should be cheap. Where the notes
+// cannot be emitted, or with SIMPLEFS_NO_PROBES defined, probes compile
+// to nothing.
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(SIMPLEFS_NO_PROBES)
+
+#define PROBE_NOTE(name, args) \
+	"990:	nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	.8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"simplefs\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define PROBE_ARG(n, x) [a##n] "nor" ((long long)(x))
+
+#define PROBE0(name) \
+	__asm__ __volatile__(PROBE_NOTE(name, ""))
+#define PROBE1(name, a1) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1]") :: PROBE_ARG(1, a1))
+#define PROBE2(name, a1, a2) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1] -8@%[a2]") :: PROBE_ARG(1, a1), PROBE_ARG(2, a2))
+#define PROBE3(name, a1, a2, a3) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3]") :: PROBE_ARG(1, a1), PROBE_ARG(2, a2), PROBE_ARG(3, a3))
+#define PROBE4(name, a1, a2, a3, a4) \
+	__asm__ __volatile__(PROBE_NOTE(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]") :: PROBE_ARG(1, a1), PROBE_ARG(2, a2), PROBE_ARG(3, a3), PROBE_ARG(4, a4))
+
+#else
+
+#define PROBE0(name)                 do {} while(0)
+#define PROBE1(name, a1)             do { (void)(a1); } while(0)
+#define PROBE2(name, a1, a2)         do { (void)(a1); (void)(a2); } while(0)
+#define PROBE3(name, a1, a2, a3)     do { (void)(a1); (void)(a2); (void)(a3); } while(0)
+#define PROBE4(name, a1, a2, a3, a4) do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while(0)
+
+#endif
+
+#endif
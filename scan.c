@@ -0,0 +1,102 @@
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "scan.h"
+#include "bitmap.h"
+
+typedef int (*scan_func)( const int *, int, int, int, uint64_t *, int );
+
+static void mark( uint64_t *bitmap, int blocknum, int isfree )
+{
+	// Freed blocks go back the way alloc_free returns them
+	if(isfree) __atomic_fetch_or(&bitmap[blocknum>>6],(uint64_t)1 << (blocknum&63),__ATOMIC_RELEASE);
+	else bitmap_clear(bitmap,blocknum);
+}
+
+static int scan_scalar( const int *p, int n, int limit, int nblocks, uint64_t *bitmap, int isfree )
+{
+	int i, found=0;
+
+	for(i=0;i<n && found<limit;i++) {
+		if(!p[i]) continue;
+		found++;
+		if((unsigned)p[i]<(unsigned)nblocks) mark(bitmap,p[i],isfree);
+	}
+	return found;
+}
+
+// Both vector kernels work a chunk at a time: a mask of the non-zero lanes
+// says how many pointers the chunk consumes, and a second mask of the lanes
+// that are also in range says which bits to touch. The chunk in which the
+// limit runs out is handed to the scalar loop so the cutoff stays exact.
+
+__attribute__((target("avx2")))
+static int scan_avx2( const int *p, int n, int limit, int nblocks, uint64_t *bitmap, int isfree )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+	const __m256i top = _mm256_set1_epi32(nblocks ^ INT32_MIN);
+	int i, found=0;
+
+	for(i=0;i+8<=n && found<limit;i+=8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p+i));
+		unsigned nonzero = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v,zero))) & 0xff;
+		if(!nonzero) continue;
+
+		int count = __builtin_popcount(nonzero);
+		if(count>limit-found) break;
+		found += count;
+
+		// Unsigned v < nblocks, done as a signed compare on biased values
+		__m256i below = _mm256_cmpgt_epi32(top,_mm256_xor_si256(v,bias));
+		unsigned valid = _mm256_movemask_ps(_mm256_castsi256_ps(below)) & nonzero;
+		while(valid) {
+			mark(bitmap,p[i+__builtin_ctz(valid)],isfree);
+			valid &= valid-1;
+		}
+	}
+	return found + scan_scalar(p+i,n-i,limit-found,nblocks,bitmap,isfree);
+}
+
+__attribute__((target("avx512f")))
+static int scan_avx512( const int *p, int n, int limit, int nblocks, uint64_t *bitmap, int isfree )
+{
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i top = _mm512_set1_epi32(nblocks);
+	int i, found=0;
+
+	for(i=0;i+16<=n && found<limit;i+=16) {
+		__m512i v = _mm512_loadu_si512((const void *)(p+i));
+		__mmask16 nonzero = _mm512_cmpneq_epi32_mask(v,zero);
+		if(!nonzero) continue;
+
+		int count = __builtin_popcount(nonzero);
+		if(count>limit-found) break;
+		found += count;
+
+		unsigned valid = _mm512_mask_cmplt_epu32_mask(nonzero,v,top);
+		while(valid) {
+			mark(bitmap,p[i+__builtin_ctz(valid)],isfree);
+			valid &= valid-1;
+		}
+	}
+	return found + scan_scalar(p+i,n-i,limit-found,nblocks,bitmap,isfree);
+}
+
+static scan_func scan_select()
+{
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) return scan_avx512;
+	if(__builtin_cpu_supports("avx2")) return scan_avx2;
+	return scan_scalar;
+}
+
+int scan_pointers( const int *pointers, int npointers, int limit, int nblocks, uint64_t *bitmap, int isfree )
+{
+	static scan_func kernel = 0;
+
+	if(limit<=0) return 0;
+	if(!kernel) kernel = scan_select();
+	return kernel(pointers,npointers,limit,nblocks,bitmap,isfree);
+}
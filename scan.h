@@ -0,0 +1,18 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+
+// Walk an array of block pointers in order and mark the blocks they name in
+// a packed bitmap: set their bits if isfree is non-zero, clear them
+// otherwise. Zero pointers are holes and are skipped. The scan stops after
+// limit non-zero pointers; pointers outside [1,nblocks) count towards the
+// limit but are never marked. Returns the number of non-zero pointers seen.
+// Bits are set with an atomic fetch-or, as alloc_free does.
+//
+// The kernel (AVX-512, AVX2 or scalar) is picked on the first call from
+// what the running CPU supports.
+
+int scan_pointers( const int *pointers, int npointers, int limit, int nblocks, uint64_t *bitmap, int isfree );
+
+#endif
@@ -1,14 +1,19 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "span.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
-static int do_copyin( const char *filename, int inumber );
-static int do_copyout( int inumber, const char *filename );
+#define CACHE_BLOCKS      1024
+#define CACHE_META_BLOCKS 256
+
+static int do_copyin( fs_t *fs, const char *filename, int inumber, int sync );
+static int do_copyout( fs_t *fs, int inumber, const char *filename );
 
 int main( int argc, char *argv[] )
 {
@@ -16,19 +21,58 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	int inumber, result, args, osync=0, usage=0;
+	enum disk_backend backend = DISK_STDIO;
+	disk_t *disk, *log=0;
+	fs_t *fs;
+
+	if(argc>=3 && !strcmp(argv[1],"-b")) {
+		for(backend=0;backend<DISK_BACKENDS;backend++) {
+			if(!strcmp(argv[2],disk_backend_name(backend))) break;
+		}
+		if(backend==DISK_BACKENDS) usage = 1;
+		argv += 2;
+		argc -= 2;
+	}
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(usage || (argc!=3 && argc!=5)) {
+		printf("use: simplefs [-b stdio|pread|direct|mmap|uring] <diskfile> <nblocks> [<logfile> <logblocks>]\n");
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	disk = disk_open_backend(argv[1],atoi(argv[2]),backend);
+	if(!disk) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size(disk));
+	if(backend!=DISK_STDIO) {
+		printf("using the %s backend\n",disk_backend_name(disk_backend(disk)));
+	}
+
+	fs = fs_open(disk);
+	if(!fs) {
+		printf("couldn't allocate a file system\n");
+		disk_close(disk);
+		return 1;
+	}
+
+	if(argc==5) {
+		log = disk_open_backend(argv[3],atoi(argv[4]),backend);
+		if(!log || !fs_intent_log(fs,log)) {
+			printf("couldn't initialize intent log %s: %s\n",argv[3],strerror(errno));
+			fs_close(fs);
+			if(log) disk_close(log);
+			disk_close(disk);
+			return 1;
+		}
+		printf("opened intent log %s with %d blocks\n",argv[3],disk_size(log));
+	}
+
+	if(!fs_cache_size(fs,CACHE_BLOCKS,CACHE_META_BLOCKS)) {
+		printf("couldn't allocate a block cache, running without one\n");
+	}
 
 	while(1) {
 		printf(" simplefs> ");
@@ -44,34 +88,77 @@ int main( int argc, char *argv[] )
 
 		if(!strcmp(cmd,"format")) {
 			if(args==1) {
-				if(fs_format()) {
+				if(fs_format(fs)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
+			} else if(args==2 && !strcmp(arg1,"log")) {
+				if(fs_format_log(fs)) {
+					printf("disk formatted, log-structured.\n");
+				} else {
+					printf("format failed!\n");
+				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [log]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
-				if(fs_mount()) {
+				if(fs_mount(fs)) {
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
 				}
+			} else if(args==2 && !strcmp(arg1,"lazy")) {
+				if(fs_mount_lazy(fs)) {
+					printf("disk mounted, scanning in the background.\n");
+				} else {
+					printf("mount failed!\n");
+				}
+			} else {
+				printf("use: mount [lazy]\n");
+			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount(fs)) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
+		} else if(!strcmp(cmd,"trim")) {
+			if(args==1) {
+				result = fs_trim(fs);
+				if(result>=0) {
+					printf("%d blocks trimmed\n",result);
+				} else {
+					printf("trim failed!\n");
+				}
+			} else {
+				printf("use: trim\n");
+			}
+		} else if(!strcmp(cmd,"resize")) {
+			if(args==2) {
+				if(fs_resize(fs,atoi(arg1))) {
+					printf("disk resized to %d blocks.\n",disk_size(disk));
+				} else {
+					printf("resize failed!\n");
+				}
 			} else {
-				printf("use: mount\n");
+				printf("use: resize <nblocks>\n");
 			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
-				fs_debug();
+				fs_debug(fs);
 			} else {
 				printf("use: debug\n");
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
+				result = fs_getsize(fs,inumber);
 				if(result>=0) {
 					printf("inode %d has size %d\n",inumber,result);
 				} else {
@@ -81,32 +168,197 @@ int main( int argc, char *argv[] )
 				printf("use: getsize <inumber>\n");
 			}
 			
+		} else if(!strcmp(cmd,"df")) {
+			if(args==1) {
+				int ninodes, nfree, ndeleting;
+				long long used;
+				if(fs_stat(fs,&ninodes,&nfree,&ndeleting,&used)) {
+					if(ndeleting) {
+						printf("%d inodes in use, %d free, %d being deleted, %lld bytes used\n",ninodes,nfree,ndeleting,used);
+					} else {
+						printf("%d inodes in use, %d free, %lld bytes used\n",ninodes,nfree,used);
+					}
+				} else {
+					printf("df failed!\n");
+				}
+			} else {
+				printf("use: df\n");
+			}
+		} else if(!strcmp(cmd,"find")) {
+			if(args==2) {
+				int inumbers[256];
+				int i, count = fs_find(fs,atoi(arg1),inumbers,256);
+				if(count>=0) {
+					for(i=0;i<count;i++) {
+						printf("inode %d has size %d\n",inumbers[i],fs_getsize(fs,inumbers[i]));
+					}
+					printf("%d inodes found\n",count);
+				} else {
+					printf("find failed!\n");
+				}
+			} else {
+				printf("use: find <minsize>\n");
+			}
+		} else if(!strcmp(cmd,"cache")) {
+			if(args==1) {
+				struct cache_stats stats;
+				const char *names[2] = {"data","metadata"};
+				int kind;
+				fs_cache_stats(fs,&stats);
+				for(kind=0;kind<2;kind++) {
+					struct cache_partition_stats *p = &stats.part[kind];
+					printf("%s: %d blocks, recency target %d\n",names[kind],p->capacity,p->target);
+					printf("    recent:          %6d blocks, %lld hits\n",p->size[CACHE_RECENT],p->hits[CACHE_RECENT]);
+					printf("    frequent:        %6d blocks, %lld hits\n",p->size[CACHE_FREQUENT],p->hits[CACHE_FREQUENT]);
+					printf("    ghost recent:    %6d blocks, %lld hits\n",p->size[CACHE_GHOST_RECENT],p->hits[CACHE_GHOST_RECENT]);
+					printf("    ghost frequent:  %6d blocks, %lld hits\n",p->size[CACHE_GHOST_FREQUENT],p->hits[CACHE_GHOST_FREQUENT]);
+					printf("    %lld misses\n",p->misses);
+				}
+				printf("pinned: %d blocks, %lld hits\n",stats.pinned,stats.pinned_hits);
+				printf("dirty: %d blocks\n",stats.dirty);
+				printf("bypassed: %lld blocks read directly\n",stats.bypassed);
+				printf("read ahead: %lld blocks, %lld used\n",stats.prefetched,stats.prefetch_hits);
+			} else if(args==3) {
+				if(fs_cache_size(fs,atoi(arg1),atoi(arg2))) {
+					printf("cache set to %d data and %d metadata blocks\n",atoi(arg1),atoi(arg2));
+				} else {
+					printf("cache failed!\n");
+				}
+			} else {
+				printf("use: cache [<datablocks> <metablocks>]\n");
+			}
+		} else if(!strcmp(cmd,"trace")) {
+			if(args==2 && !strcmp(arg1,"off")) {
+				fs_cache_trace(fs,0);
+				printf("cache trace stopped\n");
+			} else if(args==2) {
+				if(fs_cache_trace(fs,arg1)) {
+					printf("tracing cache accesses to %s\n",arg1);
+				} else {
+					printf("couldn't open %s: %s\n",arg1,strerror(errno));
+				}
+			} else {
+				printf("use: trace <file>|off\n");
+			}
+		} else if(!strcmp(cmd,"spans")) {
+			if(args==2 && (!strcmp(arg1,"on") || !strcmp(arg1,"off"))) {
+				span_enable(!strcmp(arg1,"on"));
+				printf("spans %s\n",arg1);
+			} else if(args==2 && !strcmp(arg1,"clear")) {
+				span_clear();
+				printf("spans cleared\n");
+			} else if(args==3 && (!strcmp(arg1,"chrome") || !strcmp(arg1,"folded"))) {
+				int ok = !strcmp(arg1,"chrome") ? span_write_chrome(arg2) : span_write_folded(arg2);
+				if(ok) {
+					printf("%lld spans written to %s\n",span_count(),arg2);
+				} else {
+					printf("couldn't write %s: %s\n",arg2,strerror(errno));
+				}
+			} else {
+				printf("use: spans on|off|clear|chrome <file>|folded <file>\n");
+			}
+		} else if(!strcmp(cmd,"pin")) {
+			if(args==2) {
+				fs_pin_inodes(fs,atoi(arg1));
+				printf("inode tables up to %d blocks will be pinned at mount\n",atoi(arg1));
+			} else {
+				printf("use: pin <maxblocks>\n");
+			}
+		} else if(!strcmp(cmd,"writeback")) {
+			if(args==3) {
+				fs_writeback(fs,atoi(arg1),atoi(arg2));
+				if(atoi(arg1)>0) {
+					printf("data written back after %d ms, writers slowed at %d%% dirty\n",atoi(arg1),atoi(arg2));
+				} else {
+					printf("data written through\n");
+				}
+			} else {
+				printf("use: writeback <expire ms> <dirty percent>\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync(fs)) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else if(args==2 && !strcmp(arg1,"stats")) {
+				struct fs_sync_stats stats;
+				fs_sync_stats(fs,&stats);
+				printf("%lld sync calls served by %lld disk syncs",stats.calls,stats.flushes);
+				if(stats.flushes>0) printf(", %.2f calls per sync",(double)stats.calls/stats.flushes);
+				printf("\n");
+				if(log) {
+					printf("%lld synchronous writes logged, %lld log syncs, %lld checkpoints\n",stats.intent_writes,stats.intent_flushes,stats.intent_checkpoints);
+				}
+			} else {
+				printf("use: sync [stats]\n");
+			}
+		} else if(!strcmp(cmd,"fsync")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				if(fs_fsync(fs,inumber)) {
+					printf("inode %d synced.\n",inumber);
+				} else {
+					printf("fsync failed!\n");
+				}
+			} else {
+				printf("use: fsync <inumber>\n");
+			}
+		} else if(!strcmp(cmd,"osync")) {
+			if(args==2 && (!strcmp(arg1,"on") || !strcmp(arg1,"off"))) {
+				osync = !strcmp(arg1,"on");
+				printf("copyin writes are %s\n",osync ? "synchronous" : "buffered");
+			} else {
+				printf("use: osync on|off\n");
+			}
 		} else if(!strcmp(cmd,"create")) {
 			if(args==1) {
-				inumber = fs_create();
+				inumber = fs_create(fs);
 				if(inumber>0) {
 					printf("created inode %d\n",inumber);
 				} else {
 					printf("create failed!\n");
 				}
+			} else if(args==2 && atoi(arg1)>0) {
+				int count = atoi(arg1);
+				int *inumbers = malloc(count*sizeof(int));
+				result = inumbers ? fs_create_many(fs,count,inumbers) : 0;
+				if(result>0) {
+					printf("created %d inodes, %d to %d\n",result,inumbers[0],inumbers[result-1]);
+				} else {
+					printf("create failed!\n");
+				}
+				free(inumbers);
 			} else {
-				printf("use: create\n");
+				printf("use: create [<count>]\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
+			int first, last;
+			if(args==2 && sscanf(arg1,"%d-%d",&first,&last)==2) {
+				int i, *inumbers = last>=first ? malloc((last-first+1)*sizeof(int)) : 0;
+				if(inumbers) {
+					for(i=first;i<=last;i++) inumbers[i-first] = i;
+					result = fs_delete_many(fs,inumbers,last-first+1);
+					printf("%d inodes deleted.\n",result);
+					free(inumbers);
+				} else {
+					printf("delete failed!\n");
+				}
+			} else if(args==2) {
 				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
+				if(fs_delete(fs,inumber)) {
 					printf("inode %d deleted.\n",inumber);
 				} else {
 					printf("delete failed!\n");	
 				}
 			} else {
-				printf("use: delete <inumber>\n");
+				printf("use: delete <inumber>|<first>-<last>\n");
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
+				if(!do_copyout(fs,inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
@@ -116,7 +368,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
 				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
+				if(do_copyin(fs,arg1,inumber,osync)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
@@ -128,7 +380,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
 				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
+				if(do_copyout(fs,inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
@@ -139,11 +391,24 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
+			printf("    format  [log]\n");
+			printf("    mount   [lazy]\n");
+			printf("    unmount\n");
+			printf("    trim\n");
+			printf("    resize  <nblocks>\n");
 			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
+			printf("    create  [<count>]\n");
+			printf("    df\n");
+			printf("    find    <minsize>\n");
+			printf("    cache   [<datablocks> <metablocks>]\n");
+			printf("    trace   <file>|off\n");
+			printf("    spans   on|off|clear|chrome <file>|folded <file>\n");
+			printf("    pin     <maxblocks>\n");
+			printf("    writeback <expire ms> <dirty percent>\n");
+			printf("    sync    [stats]\n");
+			printf("    fsync   <inode>\n");
+			printf("    osync   on|off\n");
+			printf("    delete  <inode>|<first>-<last>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
@@ -161,13 +426,16 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	fs_close(fs);
+
 	printf("closing emulated disk.\n");
-	disk_close();
+	disk_close(disk);
+	if(log) disk_close(log);
 
 	return 0;
 }
 
-static int do_copyin( const char *filename, int inumber )
+static int do_copyin( fs_t *fs, const char *filename, int inumber, int sync )
 {
 	FILE *file;
 	int offset=0, result, actual;
@@ -183,7 +451,7 @@ static int do_copyin( const char *filename, int inumber )
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = sync ? fs_write_sync(fs,inumber,buffer,result,offset) : fs_write(fs,inumber,buffer,result,offset);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
 				break;
@@ -202,7 +470,7 @@ static int do_copyin( const char *filename, int inumber )
 	return 1;
 }
 
-static int do_copyout( int inumber, const char *filename )
+static int do_copyout( fs_t *fs, int inumber, const char *filename )
 {
 	FILE *file;
 	int offset=0, result;
@@ -214,12 +482,15 @@ static int do_copyout( int inumber, const char *filename )
 		return 0;
 	}
 
+	// The file is streamed out once, so read ahead and don't keep it
+	fs_advise(fs,inumber,0,0,FS_ADVISE_SEQUENTIAL|FS_ADVISE_NOREUSE);
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_read(fs,inumber,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
+	fs_advise(fs,inumber,0,0,FS_ADVISE_NORMAL);
 
 	printf("%d bytes copied\n",offset);
 
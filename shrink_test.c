@@ -0,0 +1,92 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Shrink an image with write-back on, so the relocated copies start out
+// dirty in the cache, then read the files back through a second instance
+// on the same image with no cache in front of it. Whatever the shrink
+// left only in the cache of the first instance reads back wrong.
+
+#define NBLOCKS 1000
+#define SHRUNK  400
+#define FILES   20
+#define BLOCKS  20 // per file
+
+static void fill( char *data, int file )
+{
+	int i;
+
+	for(i=0;i<BLOCKS*DISK_BLOCK_SIZE;i++) data[i] = file*31 + i*7;
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *filename = argc>1 ? argv[1] : "shrink_test.img";
+	static char data[BLOCKS*DISK_BLOCK_SIZE], check[BLOCKS*DISK_BLOCK_SIZE];
+	int inumbers[FILES];
+	disk_t *disk, *image;
+	fs_t *fs, *reader;
+	struct stat info;
+	int f, errors = 0;
+
+	unlink(filename);
+	disk = disk_open_backend(filename,NBLOCKS,DISK_PREAD);
+	fs = disk ? fs_open(disk) : 0;
+	if(!fs || !fs_cache_size(fs,1024,64) || !fs_format(fs) || !fs_mount(fs)) {
+		printf("couldn't set up the file system\n");
+		return 1;
+	}
+
+	// Fill the image from the front, then free the front half so the
+	// files at the back have to move
+	for(f=0;f<FILES;f++) {
+		inumbers[f] = fs_create(fs);
+		fill(data,f);
+		if(fs_write(fs,inumbers[f],data,sizeof(data),0)!=sizeof(data)) errors++;
+	}
+	fs_sync(fs);
+	for(f=0;f<FILES/2;f++) fs_delete(fs,inumbers[f]);
+
+	// Keep the flusher away from the copies
+	fs_writeback(fs,60*60*1000,100);
+	if(!fs_resize(fs,SHRUNK)) {
+		printf("shrink failed\n");
+		return 1;
+	}
+
+	if(stat(filename,&info)<0 || info.st_size!=(off_t)SHRUNK*DISK_BLOCK_SIZE) {
+		printf("image was not cut to %d blocks\n",SHRUNK);
+		errors++;
+	}
+	image = disk_open_backend(filename,SHRUNK,DISK_PREAD);
+	reader = image ? fs_open(image) : 0;
+	if(!reader || !fs_mount(reader)) {
+		printf("couldn't mount the shrunk image\n");
+		return 1;
+	}
+	for(f=FILES/2;f<FILES;f++) {
+		fill(data,f);
+		if(fs_read(reader,inumbers[f],check,sizeof(check),0)!=sizeof(check) || memcmp(data,check,sizeof(check))) {
+			printf("file %d reads back wrong\n",inumbers[f]);
+			errors++;
+		}
+	}
+	fs_close(reader);
+	disk_close(image);
+
+	fs_close(fs);
+	disk_close(disk);
+	unlink(filename);
+
+	if(errors) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,267 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "span.h"
+
+#define SPAN_RING  16384 // spans kept per thread
+#define SPAN_DEPTH 64    // deepest nesting written out as a stack
+#define SPAN_PATH  1024
+
+struct span_event {
+	const char *name;
+	long long arg;
+	uint64_t start;
+	uint64_t end;
+	int depth; // spans open around it on its thread
+};
+
+// Only the owning thread writes events and moves head. A reader copies
+// what it wants, then looks at head again to see what was overwritten
+// meanwhile.
+struct span_ring {
+	struct span_event events[SPAN_RING];
+	uint64_t head; // spans ever recorded
+	uint64_t tail; // those before it were cleared
+	int tid;
+	struct span_ring *next;
+};
+
+int span_on;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct span_ring *rings;
+static int nrings;
+static uint64_t epoch; // when recording was first turned on
+
+static __thread struct span_ring *ring;
+static __thread int depth;
+
+static uint64_t now_ns()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+// A thread's ring is made the first time it finishes a span, and kept
+// after the thread is gone so its spans can still be written out
+static struct span_ring *ring_get()
+{
+	struct span_ring *r;
+
+	if(ring) return ring;
+	r = calloc(1,sizeof(struct span_ring));
+	if(!r) return 0;
+	pthread_mutex_lock(&rings_lock);
+	r->tid = ++nrings;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	ring = r;
+	return r;
+}
+
+struct span_scope span_begin_slow( const char *name, long long arg )
+{
+	struct span_scope s = {name,arg,now_ns()};
+	depth++;
+	return s;
+}
+
+void span_end_slow( struct span_scope *s )
+{
+	struct span_ring *r = ring_get();
+	uint64_t end = now_ns();
+
+	depth--;
+	if(!r) return;
+
+	struct span_event *e = &r->events[r->head%SPAN_RING];
+	e->name = s->name;
+	e->arg = s->arg;
+	e->start = s->start;
+	e->end = end;
+	e->depth = depth;
+	__atomic_store_n(&r->head,r->head+1,__ATOMIC_RELEASE);
+}
+
+void span_enable( int on )
+{
+	pthread_mutex_lock(&rings_lock);
+	if(on && !epoch) epoch = now_ns();
+	pthread_mutex_unlock(&rings_lock);
+	__atomic_store_n(&span_on,on,__ATOMIC_RELAXED);
+}
+
+void span_clear()
+{
+	struct span_ring *r;
+
+	pthread_mutex_lock(&rings_lock);
+	for(r=rings;r;r=r->next) r->tail = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&rings_lock);
+}
+
+// Copy out the spans a ring still holds, oldest first. Returns how many.
+static int ring_copy( struct span_ring *r, struct span_event *events )
+{
+	uint64_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE), first = r->tail, i;
+
+	if(head-first>SPAN_RING) first = head-SPAN_RING;
+	for(i=first;i<head;i++) events[i-first] = r->events[i%SPAN_RING];
+
+	// Anything the owner has started to write over since is dropped
+	uint64_t now = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+	uint64_t skip = now>=SPAN_RING && now-SPAN_RING+1>first ? now-SPAN_RING+1-first : 0;
+	if(skip>head-first) skip = head-first;
+	memmove(events,events+skip,(head-first-skip)*sizeof(struct span_event));
+	return head-first-skip;
+}
+
+long long span_count()
+{
+	struct span_ring *r;
+	long long n = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for(r=rings;r;r=r->next) {
+		uint64_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+		n += head-r->tail>SPAN_RING ? SPAN_RING : head-r->tail;
+	}
+	pthread_mutex_unlock(&rings_lock);
+	return n;
+}
+
+int span_write_chrome( const char *filename )
+{
+	struct span_event *events = malloc(SPAN_RING*sizeof(struct span_event));
+	FILE *file = fopen(filename,"w");
+	struct span_ring *r;
+	int i, n, first = 1;
+
+	if(!events || !file) {
+		free(events);
+		if(file) fclose(file);
+		return 0;
+	}
+
+	fprintf(file,"{\"traceEvents\":[\n");
+	pthread_mutex_lock(&rings_lock);
+	for(r=rings;r;r=r->next) {
+		n = ring_copy(r,events);
+		for(i=0;i<n;i++) {
+			struct span_event *e = &events[i];
+			fprintf(file,"%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",first ? "" : ",\n",
+				e->name,r->tid,(e->start-epoch)/1e3,(e->end-e->start)/1e3);
+			if(e->arg>=0) fprintf(file,",\"args\":{\"arg\":%lld}",e->arg);
+			fprintf(file,"}");
+			first = 0;
+		}
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fprintf(file,"\n],\"displayTimeUnit\":\"ns\"}\n");
+	free(events);
+	return fclose(file)==0;
+}
+
+// Folded stacks
+
+struct folded {
+	char *path;
+	uint64_t self;
+};
+
+static int event_compare( const void *a, const void *b )
+{
+	const struct span_event *x = a, *y = b;
+	if(x->start!=y->start) return x->start<y->start ? -1 : 1;
+	return x->depth-y->depth;
+}
+
+static int folded_compare( const void *a, const void *b )
+{
+	return strcmp(((const struct folded *)a)->path,((const struct folded *)b)->path);
+}
+
+// Walk one thread's spans in order of start, keeping the stack of spans
+// that contain the current one. The first walk takes each span's time
+// out of its parent; the second gives every span a line of its own.
+static int fold( struct span_event *events, int n, uint64_t *children, struct folded *out )
+{
+	int stack[SPAN_DEPTH], top, i, j, walk, nout = 0;
+	char path[SPAN_PATH];
+
+	qsort(events,n,sizeof(struct span_event),event_compare);
+	memset(children,0,n*sizeof(uint64_t));
+
+	for(walk=0;walk<2;walk++) {
+		top = 0;
+		for(i=0;i<n;i++) {
+			struct span_event *e = &events[i];
+			while(top>0 && (top>e->depth || events[stack[top-1]].end<=e->start)) top--;
+
+			if(walk==0) {
+				if(top>0) children[stack[top-1]] += e->end-e->start;
+			} else {
+				uint64_t self = e->end-e->start;
+				int length = 0;
+				self = self>children[i] ? self-children[i] : 0;
+				for(j=0;j<top;j++) {
+					length += snprintf(path+length,SPAN_PATH-length,"%s;",events[stack[j]].name);
+					if(length>=SPAN_PATH) break;
+				}
+				if(length<SPAN_PATH) snprintf(path+length,SPAN_PATH-length,"%s",e->name);
+				out[nout].path = strdup(path);
+				out[nout].self = self;
+				if(out[nout].path) nout++;
+			}
+			if(top<SPAN_DEPTH) stack[top++] = i;
+		}
+	}
+	return nout;
+}
+
+int span_write_folded( const char *filename )
+{
+	struct span_event *events = malloc(SPAN_RING*sizeof(struct span_event));
+	uint64_t *children = malloc(SPAN_RING*sizeof(uint64_t));
+	struct folded *lines = 0, *more;
+	struct span_ring *r;
+	FILE *file = fopen(filename,"w");
+	int i, j, n, nlines = 0;
+
+	if(!events || !children || !file) {
+		free(events);
+		free(children);
+		if(file) fclose(file);
+		return 0;
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	for(r=rings;r;r=r->next) {
+		n = ring_copy(r,events);
+		more = realloc(lines,(nlines+n+1)*sizeof(struct folded));
+		if(!more) break;
+		lines = more;
+		nlines += fold(events,n,children,lines+nlines);
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	// One line per distinct stack, as flamegraph.pl expects
+	qsort(lines,nlines,sizeof(struct folded),folded_compare);
+	for(i=0;i<nlines;i=j) {
+		uint64_t self = 0;
+		for(j=i;j<nlines && !strcmp(lines[j].path,lines[i].path);j++) self += lines[j].self;
+		if(self>=1000) fprintf(file,"%s %llu\n",lines[i].path,(unsigned long long)(self/1000));
+	}
+
+	for(i=0;i<nlines;i++) free(lines[i].path);
+	free(lines);
+	free(events);
+	free(children);
+	return fclose(file)==0;
+}
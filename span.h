@@ -0,0 +1,58 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stdint.h>
+
+// Scoped timing spans, for seeing where the time inside one slow call
+// went. A span declared with SPAN lasts until the enclosing scope is left,
+// and spans opened inside it are its children:
+//
+//	SPAN("inode_save", inumber);
+//
+// The argument is kept with the span (an inumber, a block number), or -1
+// for none. Names must be string literals, or live as long as the process.
+//
+// Each thread records the spans it finishes into a ring of its own, so
+// recording takes no lock; when a ring is full the oldest spans are
+// overwritten. Recording is off until span_enable, and while it is off a
+// span costs a load and a branch at each end.
+//
+// The rings can be written out as Chrome trace events (chrome://tracing,
+// Perfetto) or as folded stacks for flamegraph.pl, with time spent in a
+// span itself, not in its children, in microseconds. Spans still being
+// recorded while they are written out may be left out.
+
+struct span_scope {
+	const char *name;
+	long long arg;
+	uint64_t start; // 0 if recording was off when the span opened
+};
+
+extern int span_on;
+
+struct span_scope span_begin_slow( const char *name, long long arg );
+void span_end_slow( struct span_scope *s );
+
+static inline struct span_scope span_begin( const char *name, long long arg )
+{
+	struct span_scope s = {0,0,0};
+	if(__builtin_expect(__atomic_load_n(&span_on,__ATOMIC_RELAXED),0)) s = span_begin_slow(name,arg);
+	return s;
+}
+
+static inline void span_end( struct span_scope *s )
+{
+	if(__builtin_expect(s->start!=0,0)) span_end_slow(s);
+}
+
+#define SPAN_JOIN2(a,b) a##b
+#define SPAN_JOIN(a,b)  SPAN_JOIN2(a,b)
+#define SPAN(name,arg)  struct span_scope SPAN_JOIN(span_,__LINE__) __attribute__((cleanup(span_end))) = span_begin(name,arg)
+
+void span_enable( int on );
+void span_clear();
+long long span_count();
+int  span_write_chrome( const char *filename );
+int  span_write_folded( const char *filename );
+
+#endif
@@ -0,0 +1,80 @@
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Threads calling fs_fsync and fs_write_sync at once, each on a file of
+// its own, without an intent log, so both go through the group commit on
+// the image. Every call must return, and concurrent calls must share
+// syncs: fewer syncs than calls. A thread left waiting for a sync that
+// never comes is caught by an alarm.
+
+#define THREADS 8
+#define CALLS   200
+#define TIMEOUT 30 // s
+
+static fs_t *fs;
+static int inumbers[THREADS];
+static int errors;
+
+static void *worker( void *arg )
+{
+	long t = (long)arg;
+	char data[DISK_BLOCK_SIZE];
+	int i;
+
+	memset(data,'a'+t,sizeof(data));
+	for(i=0;i<CALLS;i++) {
+		if(t%2) {
+			if(fs_write_sync(fs,inumbers[t],data,sizeof(data),0)!=sizeof(data)) __atomic_fetch_add(&errors,1,__ATOMIC_RELAXED);
+		} else {
+			if(fs_write(fs,inumbers[t],data,sizeof(data),0)!=sizeof(data)) __atomic_fetch_add(&errors,1,__ATOMIC_RELAXED);
+			if(!fs_fsync(fs,inumbers[t])) __atomic_fetch_add(&errors,1,__ATOMIC_RELAXED);
+		}
+	}
+	return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *filename = argc>1 ? argv[1] : "sync_test.img";
+	pthread_t threads[THREADS];
+	struct fs_sync_stats stats;
+	disk_t *disk;
+	long t;
+
+	alarm(TIMEOUT);
+
+	disk = disk_open(filename,1000);
+	if(!disk) {
+		printf("couldn't open %s\n",filename);
+		return 1;
+	}
+	fs = fs_open(disk);
+	if(!fs || !fs_cache_size(fs,256,64) || !fs_format(fs) || !fs_mount(fs)) {
+		printf("couldn't set up the file system\n");
+		return 1;
+	}
+	for(t=0;t<THREADS;t++) inumbers[t] = fs_create(fs);
+
+	for(t=0;t<THREADS;t++) pthread_create(&threads[t],0,worker,(void *)t);
+	for(t=0;t<THREADS;t++) pthread_join(threads[t],0);
+
+	fs_sync_stats(fs,&stats);
+	printf("%d threads: %lld sync calls, %lld syncs, %d errors\n",THREADS,stats.calls,stats.flushes,errors);
+	fs_close(fs);
+	disk_close(disk);
+	unlink(filename);
+
+	if(errors || stats.calls!=(long long)THREADS*CALLS || stats.flushes>=stats.calls) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,170 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+// The submission and completion rings are shared with the kernel. We are
+// the only producer of submissions and the only consumer of completions,
+// so only the indexes the kernel moves need atomic loads.
+
+struct uring {
+	int fd;
+	unsigned entries;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+static int enter( struct uring *r, unsigned submit, unsigned wait )
+{
+	return syscall(__NR_io_uring_enter,r->fd,submit,wait,wait ? IORING_ENTER_GETEVENTS : 0,0,0);
+}
+
+struct uring *uring_open( unsigned entries )
+{
+	struct io_uring_params p;
+	struct uring *r = calloc(1,sizeof(struct uring));
+	if(!r) return 0;
+
+	memset(&p,0,sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup,entries,&p);
+	if(r->fd<0) {
+		free(r);
+		return 0;
+	}
+	r->entries = p.sq_entries;
+
+	// Older kernels map the two rings separately
+	r->sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cq_size>r->sq_size) r->sq_size = r->cq_size;
+	}
+	r->sq_ring = mmap(0,r->sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQ_RING);
+	if(r->sq_ring==MAP_FAILED) r->sq_ring = 0;
+	if(r->sq_ring && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		r->cq_ring = r->sq_ring;
+	} else if(r->sq_ring) {
+		r->cq_ring = mmap(0,r->cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_CQ_RING);
+		if(r->cq_ring==MAP_FAILED) r->cq_ring = 0;
+	}
+	r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	r->sqes = mmap(0,r->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+	if(r->sqes==MAP_FAILED) r->sqes = 0;
+	if(!r->sq_ring || !r->cq_ring || !r->sqes) {
+		uring_close(r);
+		return 0;
+	}
+
+	char *sq = r->sq_ring, *cq = r->cq_ring;
+	r->sq_head = (unsigned *)(sq+p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq+p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq+p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq+p.sq_off.array);
+	r->cq_head = (unsigned *)(cq+p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq+p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq+p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq+p.cq_off.cqes);
+	return r;
+}
+
+// The kernel may move less than was asked for; the rest is moved with
+// plain system calls
+static int finish( int fd, int write, const struct uring_io *io, size_t done )
+{
+	ssize_t result;
+
+	while(done<io->length) {
+		if(write) {
+			result = pwrite(fd,io->data+done,io->length-done,io->offset+done);
+		} else {
+			result = pread(fd,io->data+done,io->length-done,io->offset+done);
+		}
+		if(result<0 && errno==EINTR) continue;
+		if(result==0) errno = EIO; // past the end of the file
+		if(result<=0) return 0;
+		done += result;
+	}
+	return 1;
+}
+
+// Keep up to a ring's worth of requests in flight until all have completed.
+// Returns 0 with errno set if any failed; a ring whose io_uring_enter
+// failed may still hold requests and must be closed.
+int uring_rw( struct uring *r, int fd, int write, const struct uring_io *ios, int count )
+{
+	int submitted = 0, done = 0, error = 0;
+
+	while(done<count) {
+		unsigned tail = *r->sq_tail;
+		while(submitted<count && submitted-done<(int)r->entries) {
+			unsigned index = tail & *r->sq_mask;
+			struct io_uring_sqe *sqe = &r->sqes[index];
+			memset(sqe,0,sizeof(*sqe));
+			sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = (unsigned long)ios[submitted].data;
+			sqe->len = ios[submitted].length;
+			sqe->off = ios[submitted].offset;
+			sqe->user_data = submitted;
+			r->sq_array[index] = index;
+			tail++;
+			submitted++;
+		}
+		__atomic_store_n(r->sq_tail,tail,__ATOMIC_RELEASE);
+
+		unsigned pending = tail - __atomic_load_n(r->sq_head,__ATOMIC_ACQUIRE);
+		if(enter(r,pending,1)<0 && errno!=EINTR) return 0;
+
+		unsigned head = *r->cq_head;
+		while(head!=__atomic_load_n(r->cq_tail,__ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			const struct uring_io *io = &ios[cqe->user_data];
+			if(cqe->res<0) {
+				if(!error) error = -cqe->res;
+			} else if(!finish(fd,write,io,cqe->res)) {
+				if(!error) error = errno;
+			}
+			head++;
+			done++;
+		}
+		__atomic_store_n(r->cq_head,head,__ATOMIC_RELEASE);
+	}
+
+	if(error) {
+		errno = error;
+		return 0;
+	}
+	return 1;
+}
+
+void uring_close( struct uring *r )
+{
+	if(!r) return;
+	if(r->sqes) munmap(r->sqes,r->sqes_size);
+	if(r->cq_ring && r->cq_ring!=r->sq_ring) munmap(r->cq_ring,r->cq_size);
+	if(r->sq_ring) munmap(r->sq_ring,r->sq_size);
+	close(r->fd);
+	free(r);
+}
@@ -0,0 +1,23 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+
+// A minimal io_uring, set up with raw system calls so there is nothing to
+// link against. One ring serves one caller at a time: uring_rw submits a
+// batch of reads or writes on a file descriptor and waits for all of them.
+// uring_open returns 0 where the kernel has no io_uring or refuses it.
+
+struct uring;
+
+struct uring_io {
+	char *data;
+	off_t offset;
+	size_t length;
+};
+
+struct uring *uring_open( unsigned entries );
+int  uring_rw( struct uring *r, int fd, int write, const struct uring_io *ios, int count );
+void uring_close( struct uring *r );
+
+#endif
@@ -0,0 +1,567 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "layout.h"
+#include "span.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Mixes of file system calls modeled on the filebench personalities, run
+// from several threads against one mounted image for a fixed time:
+//
+//	fileserver  replace a file with a new one written whole, append to
+//	            another, read a third whole and stat it
+//	varmail     replace a file with one short append and fsync, append to
+//	            another after reading it and fsync, read a third
+//	webserver   read ten files whole, then append to a log shared by all
+//	logappend   each thread appends to its own file, with an fsync every
+//	            eighth append, and starts over when the file is full
+//
+// Each thread works on its own share of the file set, so no two threads
+// change the same file. Whole-file reads and writes are timed as one call.
+// The report gives throughput and latency percentiles per kind of call,
+// and how many bytes the disk moved for each byte asked for.
+//
+// File and append sizes are whole blocks, so appends start on a block
+// boundary.
+
+#define MAX_FILE     ((POINTERS_PER_INODE+POINTERS_PER_BLOCK)*DISK_BLOCK_SIZE)
+#define CHUNK        (1024*1024) // largest single fs_read or fs_write
+#define READS_PER_LOG 10         // webserver reads per log append
+#define FSYNC_EVERY  8           // logappend appends per fsync
+
+enum op { OP_CREATE, OP_DELETE, OP_WRITE, OP_APPEND, OP_READ, OP_FSYNC, OP_STAT, NOPS };
+
+static const char *op_names[NOPS] = {"create","delete","write","append","read","fsync","stat"};
+
+// A file size distribution: fixed:<bytes>, uniform:<min>:<max> or exp:<mean>
+struct sizes {
+	char kind;
+	int a;
+	int b;
+};
+
+struct latencies {
+	double *us;
+	int n;
+	int max;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned long long rng;
+	int first;  // its share of the file set
+	int count;
+	int appends;
+	char *buffer;
+	struct latencies lat[NOPS];
+	long long bytes_read;
+	long long bytes_written;
+	long long errors;
+};
+
+struct personality {
+	const char *name;
+	void (*step)( struct worker *w );
+	int files;       // default size of the file set
+	const char *sizes;
+};
+
+static fs_t *fs;
+static int *files; // inumber in each slot of the file set, 0 if none
+static int nfiles;
+static struct sizes file_sizes;
+static int append_size = 16384;
+static char *pattern; // MAX_FILE bytes that are written over and over
+static volatile int stop;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_inumber;
+static int log_size;
+
+static unsigned long long next_random( struct worker *w )
+{
+	w->rng ^= w->rng>>12;
+	w->rng ^= w->rng<<25;
+	w->rng ^= w->rng>>27;
+	return w->rng*2685821657736338717ULL;
+}
+
+static double now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1e6 + t.tv_nsec/1e3;
+}
+
+static int whole_blocks( double bytes )
+{
+	long long n = ceil(bytes/DISK_BLOCK_SIZE);
+	if(n<1) n = 1;
+	if(n>MAX_FILE/DISK_BLOCK_SIZE) n = MAX_FILE/DISK_BLOCK_SIZE;
+	return n*DISK_BLOCK_SIZE;
+}
+
+static int pick_size( struct worker *w )
+{
+	double u = (next_random(w)>>11)*(1.0/9007199254740992.0);
+
+	switch(file_sizes.kind) {
+		case 'u': return whole_blocks(file_sizes.a + u*(file_sizes.b-file_sizes.a));
+		case 'e': return whole_blocks(-file_sizes.a*log(1-u));
+	}
+	return whole_blocks(file_sizes.a);
+}
+
+static int parse_sizes( const char *text, struct sizes *s )
+{
+	if(sscanf(text,"fixed:%d",&s->a)==1) {
+		s->kind = 'f';
+	} else if(sscanf(text,"uniform:%d:%d",&s->a,&s->b)==2 && s->b>=s->a) {
+		s->kind = 'u';
+	} else if(sscanf(text,"exp:%d",&s->a)==1) {
+		s->kind = 'e';
+	} else {
+		return 0;
+	}
+	return s->a>0;
+}
+
+static void record( struct worker *w, enum op op, double start )
+{
+	struct latencies *l = &w->lat[op];
+
+	if(l->n==l->max) {
+		int max = l->max ? 2*l->max : 1024;
+		double *us = realloc(l->us,max*sizeof(double));
+		if(!us) return;
+		l->us = us;
+		l->max = max;
+	}
+	l->us[l->n++] = now_us()-start;
+}
+
+// The calls, each timed
+
+static int do_create( struct worker *w )
+{
+	double start = now_us();
+	int inumber = fs_create(fs);
+	record(w,OP_CREATE,start);
+	if(inumber<=0) {
+		w->errors++;
+		return 0;
+	}
+	return inumber;
+}
+
+static void do_delete( struct worker *w, int inumber )
+{
+	double start = now_us();
+	if(!fs_delete(fs,inumber)) w->errors++;
+	record(w,OP_DELETE,start);
+}
+
+static void do_write( struct worker *w, int inumber, int length, int offset, enum op op )
+{
+	double start = now_us();
+	int done = 0, result;
+
+	while(done<length) {
+		int chunk = length-done<CHUNK ? length-done : CHUNK;
+		result = fs_write(fs,inumber,pattern+(offset+done)%MAX_FILE,chunk,offset+done);
+		if(result>0) done += result;
+		if(result!=chunk) break;
+	}
+	record(w,op,start);
+	w->bytes_written += done;
+	if(done!=length) w->errors++;
+}
+
+static void do_append( struct worker *w, int inumber )
+{
+	int size = fs_getsize(fs,inumber);
+	if(size<0 || size+append_size>MAX_FILE) return;
+	do_write(w,inumber,append_size,size,OP_APPEND);
+}
+
+static void do_read( struct worker *w, int inumber )
+{
+	double start = now_us();
+	int offset = 0, result;
+
+	while((result = fs_read(fs,inumber,w->buffer,CHUNK,offset))>0) {
+		offset += result;
+	}
+	record(w,OP_READ,start);
+	w->bytes_read += offset;
+}
+
+static void do_fsync( struct worker *w, int inumber )
+{
+	double start = now_us();
+	if(!fs_fsync(fs,inumber)) w->errors++;
+	record(w,OP_FSYNC,start);
+}
+
+static void do_stat( struct worker *w, int inumber )
+{
+	double start = now_us();
+	if(fs_getsize(fs,inumber)<0) w->errors++;
+	record(w,OP_STAT,start);
+}
+
+// The personalities, one step each
+
+static int slot( struct worker *w )
+{
+	return w->first + next_random(w)%w->count;
+}
+
+static void replace( struct worker *w, int i, int size )
+{
+	if(files[i]) do_delete(w,files[i]);
+	files[i] = do_create(w);
+	if(files[i] && size>0) do_write(w,files[i],size,0,OP_WRITE);
+}
+
+static void fileserver( struct worker *w )
+{
+	int i = slot(w), j = slot(w), k = slot(w);
+
+	replace(w,i,pick_size(w));
+	if(files[j]) do_append(w,files[j]);
+	if(files[k]) {
+		do_read(w,files[k]);
+		do_stat(w,files[k]);
+	}
+}
+
+static void varmail( struct worker *w )
+{
+	int i = slot(w), j = slot(w), k = slot(w);
+
+	replace(w,i,0);
+	if(files[i]) {
+		do_append(w,files[i]);
+		do_fsync(w,files[i]);
+	}
+	if(files[j]) {
+		do_read(w,files[j]);
+		do_append(w,files[j]);
+		do_fsync(w,files[j]);
+	}
+	if(files[k]) do_read(w,files[k]);
+}
+
+static void webserver( struct worker *w )
+{
+	int i;
+
+	// The file set is only read, so any thread may read any of it
+	for(i=0;i<READS_PER_LOG;i++) {
+		int f = files[next_random(w)%nfiles];
+		if(f) do_read(w,f);
+	}
+
+	pthread_mutex_lock(&log_lock);
+	if(log_inumber && log_size+append_size>MAX_FILE) {
+		do_delete(w,log_inumber);
+		log_inumber = 0;
+	}
+	if(!log_inumber) {
+		log_inumber = do_create(w);
+		log_size = 0;
+	}
+	if(log_inumber) {
+		do_write(w,log_inumber,append_size,log_size,OP_APPEND);
+		log_size += append_size;
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void logappend( struct worker *w )
+{
+	int i = w->first;
+
+	if(!files[i] || fs_getsize(fs,files[i])+append_size>MAX_FILE) replace(w,i,0);
+	if(!files[i]) return;
+	do_append(w,files[i]);
+	if(++w->appends%FSYNC_EVERY==0) do_fsync(w,files[i]);
+}
+
+static struct personality personalities[] = {
+	{"fileserver",fileserver,1000,"exp:131072"},
+	{"varmail",varmail,1000,"exp:16384"},
+	{"webserver",webserver,1000,"exp:16384"},
+	{"logappend",logappend,0,"fixed:4096"},
+};
+
+static struct personality *personality;
+
+static void *worker( void *arg )
+{
+	struct worker *w = arg;
+	while(!stop) personality->step(w);
+	return 0;
+}
+
+// Reporting
+
+static int compare_double( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x<y ? -1 : x>y;
+}
+
+static double percentile( struct latencies *l, double p )
+{
+	int i = p*l->n;
+	if(i>=l->n) i = l->n-1;
+	return l->us[i];
+}
+
+static void merge( struct latencies *into, struct latencies *from )
+{
+	int i;
+	for(i=0;i<from->n;i++) {
+		if(into->n==into->max) {
+			int max = into->max ? 2*into->max : 1024;
+			double *us = realloc(into->us,max*sizeof(double));
+			if(!us) return;
+			into->us = us;
+			into->max = max;
+		}
+		into->us[into->n++] = from->us[i];
+	}
+}
+
+static void report_line( const char *name, struct latencies *l, double seconds )
+{
+	if(l->n==0) return;
+	qsort(l->us,l->n,sizeof(double),compare_double);
+	printf("%-8s %10d %10.1f %10.1f %10.1f %10.1f %10.1f\n",name,l->n,l->n/seconds,
+		percentile(l,0.50),percentile(l,0.95),percentile(l,0.99),percentile(l,0.999));
+}
+
+static double amplification( long long blocks, long long bytes )
+{
+	return bytes ? (double)blocks*DISK_BLOCK_SIZE/bytes : 0;
+}
+
+// Copy an image so the run leaves the original as it was
+static int copy_image( const char *from, const char *to, int *nblocks )
+{
+	FILE *in = fopen(from,"r"), *out = in ? fopen(to,"w") : 0;
+	char *block = malloc(DISK_BLOCK_SIZE);
+	size_t n;
+	long long bytes = 0;
+
+	if(!in || !out || !block) {
+		if(in) fclose(in);
+		if(out) fclose(out);
+		free(block);
+		return 0;
+	}
+	while((n = fread(block,1,DISK_BLOCK_SIZE,in))>0) {
+		fwrite(block,1,n,out);
+		bytes += n;
+	}
+	fclose(in);
+	fclose(out);
+	free(block);
+	*nblocks = bytes/DISK_BLOCK_SIZE;
+	return *nblocks>0;
+}
+
+static void usage( const char *name )
+{
+	printf("use: %s [options] fileserver|varmail|webserver|logappend\n",name);
+	printf("    -t <threads>       worker threads (4)\n");
+	printf("    -d <seconds>       time budget (5)\n");
+	printf("    -n <files>         size of the file set\n");
+	printf("    -z <sizes>         file sizes: fixed:<bytes>, uniform:<min>:<max> or exp:<mean>\n");
+	printf("    -a <bytes>         append size (16384)\n");
+	printf("    -c <blocks>        data cache blocks (1024)\n");
+	printf("    -b <blocks>        size of a fresh image (65536)\n");
+	printf("    -l                 format the fresh image log-structured\n");
+	printf("    -i <image>         run on a copy of an existing image instead\n");
+	printf("    -o <file>          where the image for the run goes (workload.img)\n");
+	printf("    -T <file>          record the cache accesses of the run, for mrc\n");
+	printf("    -S <file>          record timing spans of the run, to <file>.json and <file>.folded\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	int nthreads = 4, seconds = 5, nblocks = 65536, cache_blocks = 1024, log_format = 0;
+	const char *image = 0, *scratch = "workload.img", *sizes = 0, *trace = 0, *spans = 0;
+	struct disk_stats before, after;
+	struct worker *workers;
+	struct latencies total[NOPS+1];
+	disk_t *disk;
+	int i, c, op;
+
+	nfiles = -1;
+	while((c = getopt(argc,argv,"t:d:n:z:a:c:b:li:o:T:S:"))!=-1) {
+		switch(c) {
+			case 't': nthreads = atoi(optarg); break;
+			case 'd': seconds = atoi(optarg); break;
+			case 'n': nfiles = atoi(optarg); break;
+			case 'z': sizes = optarg; break;
+			case 'a': append_size = whole_blocks(atoi(optarg)); break;
+			case 'c': cache_blocks = atoi(optarg); break;
+			case 'b': nblocks = atoi(optarg); break;
+			case 'l': log_format = 1; break;
+			case 'i': image = optarg; break;
+			case 'o': scratch = optarg; break;
+			case 'T': trace = optarg; break;
+			case 'S': spans = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(optind!=argc-1) {
+		usage(argv[0]);
+		return 1;
+	}
+	for(i=0;i<sizeof(personalities)/sizeof(personalities[0]);i++) {
+		if(!strcmp(argv[optind],personalities[i].name)) personality = &personalities[i];
+	}
+	if(!personality) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(nfiles<0) nfiles = personality->files;
+	if(personality->step==logappend) nfiles = nthreads;
+	if(!parse_sizes(sizes ? sizes : personality->sizes,&file_sizes)) {
+		printf("bad file sizes: %s\n",sizes);
+		return 1;
+	}
+	if(nthreads<=0 || seconds<=0 || nblocks<=0 || nfiles<nthreads) {
+		printf("bad arguments: need at least one file per thread\n");
+		return 1;
+	}
+
+	// Open the image and mount it, formatting it first if it is fresh
+	if(image) {
+		if(!copy_image(image,scratch,&nblocks)) {
+			printf("couldn't copy %s to %s\n",image,scratch);
+			return 1;
+		}
+	} else {
+		unlink(scratch);
+	}
+	disk = disk_open(scratch,nblocks);
+	fs = disk ? fs_open(disk) : 0;
+	if(!fs) {
+		printf("couldn't open %s\n",scratch);
+		return 1;
+	}
+	fs_cache_size(fs,cache_blocks,cache_blocks/4);
+	if(!image && !(log_format ? fs_format_log(fs) : fs_format(fs))) {
+		printf("format failed\n");
+		return 1;
+	}
+	if(!fs_mount(fs)) {
+		printf("mount failed\n");
+		return 1;
+	}
+
+	pattern = malloc(MAX_FILE);
+	files = calloc(nfiles,sizeof(int));
+	workers = calloc(nthreads,sizeof(struct worker));
+	if(!pattern || !files || !workers) {
+		printf("out of memory\n");
+		return 1;
+	}
+	for(i=0;i<MAX_FILE;i++) pattern[i] = i*7;
+
+	// Lay out the file set, then time only the run itself
+	for(i=0;i<nthreads;i++) {
+		struct worker *w = &workers[i];
+		w->rng = 0x9e3779b97f4a7c15ULL*(i+1);
+		w->first = (long long)nfiles*i/nthreads;
+		w->count = (long long)nfiles*(i+1)/nthreads - w->first;
+		w->buffer = malloc(CHUNK);
+		if(!w->buffer) {
+			printf("out of memory\n");
+			return 1;
+		}
+	}
+	if(personality->step!=logappend) {
+		for(i=0;i<nfiles;i++) {
+			struct worker *w = &workers[(long long)i*nthreads/nfiles];
+			replace(w,i,pick_size(w));
+		}
+	}
+	for(i=0;i<nthreads;i++) {
+		for(op=0;op<NOPS;op++) free(workers[i].lat[op].us);
+		memset(workers[i].lat,0,sizeof(workers[i].lat));
+		workers[i].bytes_read = workers[i].bytes_written = workers[i].errors = 0;
+	}
+	fs_sync(fs);
+	disk_stats(disk,&before);
+	if(trace && !fs_cache_trace(fs,trace)) {
+		printf("couldn't open %s\n",trace);
+		return 1;
+	}
+	if(spans) span_enable(1);
+
+	double start = now_us();
+	for(i=0;i<nthreads;i++) pthread_create(&workers[i].thread,0,worker,&workers[i]);
+	sleep(seconds);
+	stop = 1;
+	for(i=0;i<nthreads;i++) pthread_join(workers[i].thread,0);
+	double elapsed = (now_us()-start)/1e6;
+	fs_cache_trace(fs,0);
+	span_enable(0);
+
+	// Data still dirty in the cache is part of what the run wrote
+	fs_sync(fs);
+	disk_stats(disk,&after);
+
+	long long bytes_read = 0, bytes_written = 0, errors = 0;
+	memset(total,0,sizeof(total));
+	for(i=0;i<nthreads;i++) {
+		for(op=0;op<NOPS;op++) {
+			merge(&total[op],&workers[i].lat[op]);
+			merge(&total[NOPS],&workers[i].lat[op]);
+		}
+		bytes_read += workers[i].bytes_read;
+		bytes_written += workers[i].bytes_written;
+		errors += workers[i].errors;
+	}
+
+	printf("%s: %d threads, %.1f s, %d files, sizes %s, appends of %d bytes\n",personality->name,nthreads,elapsed,nfiles,sizes ? sizes : personality->sizes,append_size);
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n","call","count","ops/s","p50 us","p95 us","p99 us","p99.9 us");
+	for(op=0;op<NOPS;op++) report_line(op_names[op],&total[op],elapsed);
+	report_line("all",&total[NOPS],elapsed);
+	printf("read %lld bytes, disk read %lld blocks, %.2fx\n",bytes_read,after.reads-before.reads,amplification(after.reads-before.reads,bytes_read));
+	printf("wrote %lld bytes, disk wrote %lld blocks, %.2fx\n",bytes_written,after.writes-before.writes,amplification(after.writes-before.writes,bytes_written));
+	printf("%lld disk syncs, %lld errors\n",after.syncs-before.syncs,errors);
+	if(spans) {
+		char name[1024];
+		snprintf(name,sizeof(name),"%s.json",spans);
+		if(!span_write_chrome(name)) printf("couldn't write %s\n",name);
+		snprintf(name,sizeof(name),"%s.folded",spans);
+		if(!span_write_folded(name)) printf("couldn't write %s\n",name);
+		printf("%lld spans written to %s.json and %s.folded\n",span_count(),spans,spans);
+	}
+
+	for(op=0;op<=NOPS;op++) free(total[op].us);
+	for(i=0;i<nthreads;i++) {
+		for(op=0;op<NOPS;op++) free(workers[i].lat[op].us);
+		free(workers[i].buffer);
+	}
+	free(workers);
+	free(files);
+	free(pattern);
+	fs_close(fs);
+	disk_close(disk);
+	return 0;
+}